@@ -54,8 +54,14 @@
 #include "housediscover.h"
 #include "houselog.h"
 
+#include "housedvr_buffer.h"
 #include "housedvr_feed.h"
 #include "housedvr_store.h"
+#include "housedvr_index.h"
+#include "housedvr_host.h"
+#include "housedvr_metrics.h"
+#include "housedvr_retention.h"
+#include "housedvr_shaper.h"
 #include "housedvr_transfer.h"
 
 static int use_houseportal = 0;
@@ -64,28 +70,43 @@ static char HostName[256];
 
 static const char *dvr_status (const char *method, const char *uri,
                                   const char *data, int length) {
-    static char buffer[65537];
-    int cursor = 0;
-
-    cursor += snprintf (buffer, sizeof(buffer),
-                        "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":%lld,"
-                            "\"dvr\":{",
-                        HostName, houseportal_server(), (long long)time(0));
-
-    cursor += housedvr_feed_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, ",");
-    cursor += housedvr_store_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, ",");
-    cursor += housedvr_transfer_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "}}");
+    static HouseDvrBuffer buffer;
+
+    housedvr_buffer_reset (&buffer);
+    housedvr_buffer_printf (&buffer,
+                            "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":%lld,"
+                                "\"dvr\":{",
+                            HostName, houseportal_server(), (long long)time(0));
+
+    housedvr_feed_status (&buffer);
+    housedvr_buffer_printf (&buffer, ",");
+    housedvr_store_status (&buffer);
+    housedvr_buffer_printf (&buffer, ",");
+    housedvr_retention_status (&buffer);
+    housedvr_buffer_printf (&buffer, ",");
+    housedvr_transfer_status (&buffer);
+    housedvr_buffer_printf (&buffer, ",");
+    housedvr_metrics_status (&buffer);
+    housedvr_buffer_printf (&buffer, "}}");
     echttp_content_type_json ();
-    return buffer;
+    return buffer.data;
 }
 
+// The phases of the background processing, timed separately.
+//
+static int PhasePortal;
+static int PhaseStore;
+static int PhaseIndex;
+static int PhaseFeed;
+static int PhaseTransfer;
+static int PhaseDiscover;
+static int PhaseLog;
+
 static void dvr_background (int fd, int mode) {
 
     static time_t LastRenewal = 0;
     time_t now = time(0);
+    long long start = housedvr_metrics_microseconds ();
 
     if (use_houseportal) {
         static const char *path[] = {"dvr:/dvr"};
@@ -96,13 +117,21 @@ static void dvr_background (int fd, int mode) {
                 houseportal_register (echttp_port(4), path, 1);
             LastRenewal = now;
         }
+        start = housedvr_metrics_elapsed (PhasePortal, start);
     }
     housedvr_store_background(now);
+    start = housedvr_metrics_elapsed (PhaseStore, start);
+    housedvr_index_background(now);
+    start = housedvr_metrics_elapsed (PhaseIndex, start);
     housedvr_feed_background(now);
+    start = housedvr_metrics_elapsed (PhaseFeed, start);
     housedvr_transfer_background(now);
+    start = housedvr_metrics_elapsed (PhaseTransfer, start);
 
     housediscover (now);
+    start = housedvr_metrics_elapsed (PhaseDiscover, start);
     houselog_background (now);
+    housedvr_metrics_elapsed (PhaseLog, start);
 }
 
 static void dvr_protect (const char *method, const char *uri) {
@@ -135,11 +164,23 @@ int main (int argc, const char **argv) {
     echttp_cors_allow_method("GET");
     echttp_protect (0, dvr_protect);
 
+    housedvr_metrics_initialize (argc, argv);
+    PhasePortal = housedvr_metrics_phase ("background.portal");
+    PhaseStore = housedvr_metrics_phase ("background.store");
+    PhaseIndex = housedvr_metrics_phase ("background.index");
+    PhaseFeed = housedvr_metrics_phase ("background.feed");
+    PhaseTransfer = housedvr_metrics_phase ("background.transfer");
+    PhaseDiscover = housedvr_metrics_phase ("background.discover");
+    PhaseLog = housedvr_metrics_phase ("background.log");
+    housedvr_host_initialize (argc, argv);
     housedvr_feed_initialize (argc, argv);
     housedvr_store_initialize (argc, argv);
+    housedvr_index_initialize (argc, argv);
+    housedvr_retention_initialize (argc, argv);
+    housedvr_shaper_initialize (argc, argv);
     housedvr_transfer_initialize (argc, argv);
 
-    echttp_route_uri ("/dvr/status", dvr_status);
+    housedvr_metrics_route ("/dvr/status", dvr_status);
     echttp_static_route ("/", "/usr/local/share/house/public");
 
     echttp_background (&dvr_background);
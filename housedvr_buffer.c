@@ -0,0 +1,115 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedvr_buffer.c - A growable text buffer.
+ *
+ * SYNOPSYS:
+ *
+ * This module is used to build JSON responses that have no predictable
+ * size limit. The buffer grows as needed, and is never shrunk: it is
+ * meant to be reused from one response to the next.
+ *
+ * The content of the buffer is always a null-terminated string, which
+ * can be returned as is from an echttp route callback.
+ *
+ * A buffer must be initialized with zeroes (e.g. static) before use.
+ *
+ * void housedvr_buffer_reset (HouseDvrBuffer *buffer);
+ *
+ *    Empty the buffer, keeping the memory allocated for reuse.
+ *
+ * void housedvr_buffer_printf (HouseDvrBuffer *buffer,
+ *                              const char *format, ...);
+ *
+ *    Append formatted text at the end of the buffer.
+ *
+ * void housedvr_buffer_append (HouseDvrBuffer *buffer,
+ *                              const char *text, int length);
+ *
+ *    Append raw data at the end of the buffer.
+ *
+ * void housedvr_buffer_free (HouseDvrBuffer *buffer);
+ *
+ *    Release the memory allocated for the buffer.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "housedvr_buffer.h"
+
+static void housedvr_buffer_grow (HouseDvrBuffer *buffer, int needed) {
+
+    if (buffer->length + needed < buffer->size) return;
+
+    int size = buffer->size ? buffer->size * 2 : 4096;
+    while (buffer->length + needed >= size) size *= 2;
+
+    buffer->data = realloc (buffer->data, size);
+    buffer->size = size;
+}
+
+void housedvr_buffer_reset (HouseDvrBuffer *buffer) {
+
+    housedvr_buffer_grow (buffer, 1);
+    buffer->length = 0;
+    buffer->data[0] = 0;
+}
+
+void housedvr_buffer_printf (HouseDvrBuffer *buffer, const char *format, ...) {
+
+    va_list args;
+
+    housedvr_buffer_grow (buffer, 1);
+
+    va_start (args, format);
+    int needed = vsnprintf (buffer->data + buffer->length,
+                            buffer->size - buffer->length, format, args);
+    va_end (args);
+    if (needed < 0) return;
+
+    if (buffer->length + needed >= buffer->size) {
+        housedvr_buffer_grow (buffer, needed + 1);
+        va_start (args, format);
+        vsnprintf (buffer->data + buffer->length,
+                   buffer->size - buffer->length, format, args);
+        va_end (args);
+    }
+    buffer->length += needed;
+}
+
+void housedvr_buffer_append (HouseDvrBuffer *buffer,
+                             const char *text, int length) {
+
+    housedvr_buffer_grow (buffer, length + 1);
+    memcpy (buffer->data + buffer->length, text, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = 0;
+}
+
+void housedvr_buffer_free (HouseDvrBuffer *buffer) {
+
+    if (buffer->data) free (buffer->data);
+    buffer->data = 0;
+    buffer->length = 0;
+    buffer->size = 0;
+}
@@ -0,0 +1,32 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedvr_buffer.h - A growable text buffer.
+ */
+typedef struct {
+    char *data;
+    int   length;
+    int   size;
+} HouseDvrBuffer;
+
+void housedvr_buffer_reset (HouseDvrBuffer *buffer);
+void housedvr_buffer_printf (HouseDvrBuffer *buffer, const char *format, ...);
+void housedvr_buffer_append (HouseDvrBuffer *buffer, const char *text, int length);
+void housedvr_buffer_free (HouseDvrBuffer *buffer);
@@ -41,11 +41,12 @@
  *
  *    Initialize this module.
  *
- * int housedvr_feed_status (char *buffer, int size);
+ * void housedvr_feed_status (HouseDvrBuffer *output);
  *
- *    Return a JSON string that represents the status of the known feeds.
+ *    Append a JSON string that represents the status of the known feeds.
  *    Note that this JSON string is designed to be part of a more global
- *    HouseLight status, not a status standing on its own.
+ *    HouseLight status, not a status standing on its own. The JSON text
+ *    is cached, and is rebuilt only after a server or feed changed.
  *
  * void housedvr_feed_background (time_t now);
  *
@@ -55,12 +56,41 @@
  *
  *    A function that populates a complete list of feeds in JSON.
  *
- * LIMITATIONS:
+ * INCREMENTAL SCANS:
  *
- * This module does not track properly when to scan individual CCTV services.
- * It only tracks when to scan all CCTV services. If there is a need to scan
- * a specific CCTV service sooner (e.g. because a new file was detected),
- * then all CCTV services will be scanned sooner.
+ * Each CCTV service reports the list of all its recordings in its status.
+ * In order to avoid evaluating the same recordings again and again, this
+ * module keeps a cursor for each CCTV service: the time of the most recent
+ * recording such that all the recordings that are not more recent have
+ * been handled. When the status of a CCTV service is fetched following a
+ * change of its "updated" stamp, only the recordings more recent than this
+ * cursor are requested, using a "since" parameter. A CCTV service that does
+ * not support this parameter returns the full list anyway, and the older
+ * recordings are then filtered out locally. The periodic full scan always
+ * requests, and evaluates, the full list.
+ *
+ * POLLING:
+ *
+ * Each discovered CCTV service has its own polling schedule, so that the
+ * polls are spread over time instead of hitting all services at once:
+ * the first poll of a service is delayed by a jitter derived from its URL,
+ * and each later poll is scheduled after the service's own interval, plus
+ * a small random jitter. The interval is adaptive: it grows when a service
+ * keeps reporting the same "updated" stamp, and it is reset to a short
+ * value when the service reports new recordings. The longest interval
+ * remains well below the pruning delay, so that a quiet service is never
+ * pruned. Each service also has its own full scan period, and a full scan
+ * of one service can be rushed alone (e.g. when the transfer queue was
+ * full). The number of concurrent polls is capped (-dvr-polls option),
+ * so that a large number of services does not exhaust the HTTP client
+ * connections: the polls that are due wait for the next second. A poll
+ * also waits when its host already has too many requests in flight,
+ * including the transfers (see housedvr_host.c).
+ *
+ * A CCTV service that pushes its new recordings (/dvr/source/notify) does
+ * not need to be polled often: while such notifications keep coming, the
+ * service is polled at the longest interval, which saves most connections
+ * to that service. The polls still recover any lost notification.
  */
 
 #include <limits.h>
@@ -72,43 +102,114 @@
 
 #include <echttp.h>
 #include <echttp_json.h>
+#include <echttp_hash.h> // Just for the signature.
 
 #include "housediscover.h"
 #include "houselog.h"
 
+#include "housedvr_buffer.h"
 #include "housedvr_feed.h"
+#include "housedvr_host.h"
+#include "housedvr_metrics.h"
 #include "housedvr_transfer.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
+// The servers and feeds are kept in tables that grow as needed, and where
+// the entries of pruned servers and feeds are reused. Each table is
+// indexed using hash tables with chaining, where each bucket holds the
+// index of the first entry (or -1), and each entry holds the index of the
+// next entry in the same bucket. The servers are indexed both by name and
+// by URL (the URL of the CCTV service, as discovered).
+//
+// Each server also holds the list of its feeds, so that refreshing or
+// pruning the feeds of one server does not require to go through all feeds.
+//
+#define HOUSE_FEED_BUCKETS 256 // Must be a power of 2.
+
 typedef struct {
     char   name[128];
     long long updated;
     char   adminurl[256];
+    char   url[256];
+    long long cursor;
+    long long since;
     int    available;
     time_t timestamp;
+    unsigned int signature;
+    unsigned int urlsignature;
+    int    next;
+    int    nexturl;
+    int    feeds;
 } ServerRegistration;
 
 static ServerRegistration *Servers = 0;
 static int                 ServersCount = 0;
 static int                 ServersSize = 0;
 
+static int ServersByName[HOUSE_FEED_BUCKETS];
+static int ServersByUrl[HOUSE_FEED_BUCKETS];
+
 typedef struct {
     char  *name;
     char   server[256];
     char   url[256];
     time_t timestamp;
+    unsigned int signature;
+    int    next;
+    int    owner;
+    int    sibling;
 } FeedRegistration;
 
 static FeedRegistration *Feeds = 0;
 static int               FeedsCount = 0;
 static int               FeedsSize = 0;
 
+static int FeedsByName[HOUSE_FEED_BUCKETS];
+
 static const char *HouseFeedService = "cctv"; // Default is security DVR.
 
-static time_t HouseFeedNextFullScan = 0;
-static int    HouseFeedPolled = 0;
 static int    HouseFeedCheckPeriod = 30;
+static int    HouseFeedUrgentSpace = 1024; // MB.
+
+// Incremented each time a server or feed changes, to invalidate the
+// cached status.
+static int    HouseFeedGeneration = 0;
+
+// The polling schedule of each discovered CCTV service. Each entry is
+// allocated separately, because its address is used as the context of
+// the HTTP requests. The entries are never freed: a service that is not
+// discovered anymore is just not polled anymore.
+//
+#define HOUSE_FEED_FAST      10 // Poll interval when new recordings appear.
+#define HOUSE_FEED_SLOW      90 // Longest poll interval (less than pruning).
+#define HOUSE_FEED_FULLSCAN 300 // Period of the full scans.
+#define HOUSE_FEED_TIMEOUT   60 // A poll without response is considered lost.
+#define HOUSE_FEED_PUSHED   300 // How long a notification slows the polls.
+
+typedef struct {
+    char   url[256];
+    unsigned int signature;
+    int    next;
+    time_t seen;
+    time_t deadline;
+    time_t fullscan;
+    time_t inflight;
+    time_t notified;
+    int    interval;
+    int    host;
+    int    id;
+    unsigned int sequence;
+} PollSchedule;
+
+static PollSchedule **Polls = 0;
+static int            PollsCount = 0;
+static int            PollsSize = 0;
+
+static int PollsByUrl[HOUSE_FEED_BUCKETS];
+
+static int HouseFeedMaxPolls = 16;
+static int HouseFeedInFlight = 0;
 
 
 // This function is used to stop HouseDvr when a watchdog triggers.
@@ -120,24 +221,83 @@ static void crashandburn (void) {
     InvalidPointer[0] = 0; // Generate a crash, by choice.
 }
 
+static int housedvr_feed_find (const char *name) {
+
+    unsigned int signature = echttp_hash_signature (name);
+    int i = ServersByName[signature & (HOUSE_FEED_BUCKETS - 1)];
+    while (i >= 0) {
+        if (Servers[i].signature == signature) {
+            if (!strcmp (name, Servers[i].name)) return i;
+        }
+        i = Servers[i].next;
+    }
+    return -1;
+}
+
+static void housedvr_feed_unlink (int i) {
+
+    int *link = ServersByName + (Servers[i].signature & (HOUSE_FEED_BUCKETS - 1));
+    while (*link >= 0) {
+        if (*link == i) {
+            *link = Servers[i].next;
+            return;
+        }
+        link = &(Servers[*link].next);
+    }
+}
+
+static void housedvr_feed_unlinkurl (int i) {
+
+    int *link =
+        ServersByUrl + (Servers[i].urlsignature & (HOUSE_FEED_BUCKETS - 1));
+    while (*link >= 0) {
+        if (*link == i) {
+            *link = Servers[i].nexturl;
+            return;
+        }
+        link = &(Servers[*link].nexturl);
+    }
+}
+
+static void housedvr_feed_seturl (int i, const char *url) {
+
+    ServerRegistration *server = Servers + i;
+    if (server->url[0]) housedvr_feed_unlinkurl (i);
+    snprintf (server->url, sizeof(server->url), "%s", url);
+    if (server->url[0]) {
+        server->urlsignature = echttp_hash_signature (server->url);
+        int *bucket =
+            ServersByUrl + (server->urlsignature & (HOUSE_FEED_BUCKETS - 1));
+        server->nexturl = *bucket;
+        *bucket = i;
+    }
+}
+
 static int housedvr_feed_uptodate (const char *name, long long updated) {
 
-    int i;
-    for (i = ServersCount-1; i >= 0; --i) {
-        if (Servers[i].name[0]) {
-            if (!strcmp (name, Servers[i].name)) {
-                return (Servers[i].updated == updated);
-            }
+    int i = housedvr_feed_find (name);
+    if (i < 0) return 0; // Not found, therefore no update match.
+    return (Servers[i].updated == updated);
+}
+
+static ServerRegistration *housedvr_feed_byurl (const char *url) {
+
+    unsigned int signature = echttp_hash_signature (url);
+    int i = ServersByUrl[signature & (HOUSE_FEED_BUCKETS - 1)];
+    while (i >= 0) {
+        if (Servers[i].urlsignature == signature) {
+            if (!strcmp (url, Servers[i].url)) return Servers + i;
         }
+        i = Servers[i].nexturl;
     }
-    return 0; // Not found, therefore no update match.
+    return 0;
 }
 
 static int housedvr_feed_server (const char *name, long long updated,
-                                 const char *adminurl, const char *space) {
+                                 const char *adminurl, const char *url,
+                                 const char *space) {
 
-    int i;
-    int new = -1;
+    int new = 0;
 
     int available = atoi (space);
     const char *u;
@@ -145,32 +305,43 @@ static int housedvr_feed_server (const char *name, long long updated,
 
     if (*u == 'G') available *= 1024;  // Align on MB.
     else if (*u != 'M') available = 0; // So little left, it does not matter.
+    if (!space[0]) available = -1;     // Not reported.
 
-    for (i = ServersCount-1; i >= 0; --i) {
-        if (Servers[i].name[0]) {
-            if (!strcmp (name, Servers[i].name)) break;
-        } else {
-            new = i;
+    int i = housedvr_feed_find (name);
+    if (i < 0) {
+        // A new server: reuse a pruned entry, if any. This is rare enough
+        // that a linear search is acceptable.
+        for (i = ServersCount-1; i >= 0; --i) {
+            if (!Servers[i].name[0]) break;
         }
-    }
-    if (i >= 0) {
-        new = 0;
-    } else {
-        if (new < 0) {
+        if (i < 0) {
             if (ServersCount >= ServersSize) {
                 ServersSize += 16;
                 Servers = realloc (Servers, ServersSize * sizeof(Servers[0]));
             }
             i = ServersCount++;
-        } else {
-            i = new;
+            memset (Servers + i, 0, sizeof(Servers[0]));
         }
         snprintf (Servers[i].name, sizeof(Servers[i].name), "%s", name);
+        Servers[i].signature = echttp_hash_signature (Servers[i].name);
+        int *bucket =
+            ServersByName + (Servers[i].signature & (HOUSE_FEED_BUCKETS - 1));
+        Servers[i].next = *bucket;
+        *bucket = i;
+        Servers[i].url[0] = 0;
+        Servers[i].cursor = 0;
+        Servers[i].since = 0;
+        Servers[i].feeds = -1;
         new = 1;
     }
     if (strcmp (Servers[i].adminurl, adminurl)) {
         snprintf (Servers[i].adminurl, sizeof(Servers[i].adminurl), "%s", adminurl);
     }
+    if (url[0] && strcmp (Servers[i].url, url)) {
+        housedvr_feed_seturl (i, url);
+        Servers[i].cursor = 0; // Not the same service, start from scratch.
+        Servers[i].since = 0;
+    }
     Servers[i].timestamp = time(0);
 
     // For compatibility with the old motionCenter discovery, ignore
@@ -178,64 +349,125 @@ static int housedvr_feed_server (const char *name, long long updated,
     if (updated) Servers[i].updated = updated;
 
     Servers[i].available = available;
+    HouseFeedGeneration += 1;
     return new;
 }
 
+// A server that is short of space must have its recordings transferred
+// first, before they get deleted.
+//
+static int housedvr_feed_urgent (const ServerRegistration *server) {
+    if (server->available < 0) return 0; // Unknown.
+    return server->available < HouseFeedUrgentSpace;
+}
+
+// Remove a feed from the list of feeds of its server.
+//
+static void housedvr_feed_detach (int feed) {
+
+    int owner = Feeds[feed].owner;
+    if (owner < 0) return;
+
+    int *link = &(Servers[owner].feeds);
+    while (*link >= 0) {
+        if (*link == feed) {
+            *link = Feeds[feed].sibling;
+            break;
+        }
+        link = &(Feeds[*link].sibling);
+    }
+    Feeds[feed].owner = -1;
+}
+
 static int housedvr_feed_register (const char *name,
                                    const char *server, const char *url) {
 
-    int i;
-    int new = -1;
+    int new = 0;
 
-    for (i = FeedsCount-1; i >= 0; --i) {
-        if (Feeds[i].name) {
-            if (!strcmp (name, Feeds[i].name)) break;
-        } else {
-            new = i;
-        }
+    unsigned int signature = echttp_hash_signature (name);
+    int *bucket = FeedsByName + (signature & (HOUSE_FEED_BUCKETS - 1));
+    int i;
+    for (i = *bucket; i >= 0; i = Feeds[i].next) {
+        if (Feeds[i].signature != signature) continue;
+        if (!strcmp (name, Feeds[i].name)) break;
     }
     if (i < 0) {
-        if (new < 0) {
+        // A new feed: reuse a pruned entry, if any. This is rare enough
+        // that a linear search is acceptable.
+        for (i = FeedsCount-1; i >= 0; --i) {
+            if (!Feeds[i].name) break;
+        }
+        if (i < 0) {
             if (FeedsCount >= FeedsSize) {
                 FeedsSize += 16;
                 Feeds = realloc (Feeds, FeedsSize * sizeof(Feeds[0]));
             }
             i = FeedsCount++;
-        } else {
-            i = new;
+            memset (Feeds + i, 0, sizeof(Feeds[0]));
         }
         Feeds[i].name = strdup(name);
+        Feeds[i].signature = signature;
+        Feeds[i].next = *bucket;
+        *bucket = i;
+        Feeds[i].owner = -1;
+        Feeds[i].server[0] = 0;
         new = 1;
-    } else {
-        new = 0;
     }
     if (strcmp (Feeds[i].url, url)) {
         snprintf (Feeds[i].url, sizeof(Feeds[i].url), "%s", url);
     }
-    if (strcmp (Feeds[i].server, server)) {
+    if (strcmp (Feeds[i].server, server) || (Feeds[i].owner < 0)) {
         snprintf (Feeds[i].server, sizeof(Feeds[i].server), "%s", server);
+        housedvr_feed_detach (i);
+        int owner = housedvr_feed_find (server);
+        if (owner >= 0) {
+            Feeds[i].owner = owner;
+            Feeds[i].sibling = Servers[owner].feeds;
+            Servers[owner].feeds = i;
+        }
     }
     Feeds[i].timestamp = time(0);
+    HouseFeedGeneration += 1;
     return new;
 }
 
 static void housedvr_feed_refresh (const char *server) {
 
-    int i;
     time_t now = time(0);
 
-    for (i = FeedsCount-1; i >= 0; --i) {
-        if (!strcmp (server, Feeds[i].server)) {
-            Feeds[i].timestamp = now;
-        }
+    int i = housedvr_feed_find (server);
+    if (i < 0) return;
+
+    Servers[i].timestamp = now;
+
+    int feed;
+    for (feed = Servers[i].feeds; feed >= 0; feed = Feeds[feed].sibling) {
+        Feeds[feed].timestamp = now;
     }
+    HouseFeedGeneration += 1;
+}
 
-    for (i = ServersCount-1; i >= 0; --i) {
-        if (!strcmp (server, Servers[i].name)) {
-            Servers[i].timestamp = now;
+static void housedvr_feed_forget (int feed) {
+
+    DEBUG ("Feed %s at %s pruned\n", Feeds[feed].name, Feeds[feed].url);
+    houselog_event
+        ("FEED", Feeds[feed].name, "PRUNED", "STREAM %s", Feeds[feed].url);
+    housedvr_feed_detach (feed);
+
+    int *link = FeedsByName + (Feeds[feed].signature & (HOUSE_FEED_BUCKETS - 1));
+    while (*link >= 0) {
+        if (*link == feed) {
+            *link = Feeds[feed].next;
             break;
         }
+        link = &(Feeds[*link].next);
     }
+    free (Feeds[feed].name);
+    Feeds[feed].name = 0;
+    Feeds[feed].timestamp = 0;
+    Feeds[feed].server[0] = 0;
+    Feeds[feed].url[0] = 0;
+    HouseFeedGeneration += 1;
 }
 
 static void housedvr_feed_prune (time_t now) {
@@ -248,33 +480,45 @@ static void housedvr_feed_prune (time_t now) {
     int serverlive = 0;
     time_t deadline = now - 180;
 
-    for (i = FeedsCount-1; i >= 0; --i) {
-        if (Feeds[i].timestamp > deadline) {
-            feedlive += 1;
-            continue;
-        }
-        Feeds[i].timestamp = 0;
-        if (Feeds[i].name) {
-            DEBUG ("Feed %s at %s pruned\n", Feeds[i].name, Feeds[i].url);
-            houselog_event
-                ("FEED", Feeds[i].name, "PRUNED", "STREAM %s", Feeds[i].url);
-            free (Feeds[i].name);
-            Feeds[i].name = 0;
-            Feeds[i].server[0] = 0;
-            Feeds[i].url[0] = 0;
-        }
-    }
+    // Each feed is attached to its server, so pruning goes through each
+    // server's list of feeds. The feeds of a pruned server are pruned too.
+    //
     for (i = ServersCount-1; i >= 0; --i) {
-        if (Servers[i].timestamp > deadline) {
+        if (!Servers[i].name[0]) continue;
+
+        int expired = (Servers[i].timestamp <= deadline);
+        int feed = Servers[i].feeds;
+        while (feed >= 0) {
+            int sibling = Feeds[feed].sibling;
+            if ((!expired) && (Feeds[feed].timestamp > deadline)) {
+                feedlive += 1;
+            } else {
+                housedvr_feed_forget (feed);
+            }
+            feed = sibling;
+        }
+        if (!expired) {
             serverlive += 1;
             continue;
         }
-        if (Servers[i].name[0]) {
-            houselog_event
-                ("CCTV", Servers[i].name, "PRUNED", "ADMIN %s", Servers[i].adminurl);
-            Servers[i].timestamp = 0;
-            Servers[i].name[0] = 0;
-            Servers[i].adminurl[0] = 0;
+        houselog_event
+            ("CCTV", Servers[i].name, "PRUNED", "ADMIN %s", Servers[i].adminurl);
+        housedvr_feed_unlink (i);
+        housedvr_feed_seturl (i, "");
+        Servers[i].timestamp = 0;
+        Servers[i].name[0] = 0;
+        Servers[i].adminurl[0] = 0;
+        HouseFeedGeneration += 1;
+    }
+
+    // A feed registered before its server was known is not attached yet.
+    //
+    for (i = FeedsCount-1; i >= 0; --i) {
+        if ((!Feeds[i].name) || (Feeds[i].owner >= 0)) continue;
+        if (Feeds[i].timestamp > deadline) {
+            feedlive += 1;
+        } else {
+            housedvr_feed_forget (i);
         }
     }
 
@@ -305,6 +549,36 @@ static void housedvr_feed_prune (time_t now) {
     }
 }
 
+// Each request is tagged with the poll's identifier and sequence number,
+// so that a response arriving after its poll was declared lost, when a
+// newer request was already issued, is ignored.
+//
+static void *housedvr_feed_tag (PollSchedule *poll) {
+
+    poll->sequence = (poll->sequence + 1) & 0xffff;
+    if (!poll->sequence) poll->sequence = 1;
+    return (void *)(((long)(poll->id) << 16) | poll->sequence);
+}
+
+static PollSchedule *housedvr_feed_untag (void *origin) {
+
+    long tag = (long)origin;
+    int id = (int)(tag >> 16);
+    if ((id < 0) || (id >= PollsCount)) return 0;
+    if (Polls[id]->sequence != (tag & 0xffff)) return 0;
+    return Polls[id];
+}
+
+// The current request of a poll completed, or was declared lost.
+//
+static void housedvr_feed_done (PollSchedule *poll) {
+
+    if (!poll->inflight) return;
+    poll->inflight = 0;
+    HouseFeedInFlight -= 1;
+    housedvr_host_disconnect (poll->host);
+}
+
 // HousePortal based feed discovery: retrieve the video feed services,
 // then query each one. This function is the video feed service's response.
 //
@@ -315,17 +589,21 @@ static void housedvr_feed_scanned
    static int *InnerList = 0;
    static int TokensSize = 0;
 
-   const char *server = (const char *) origin;
+   PollSchedule *poll = housedvr_feed_untag (origin);
+   if (!poll) return; // Stale response, the poll was declared lost.
+
+   const char *server = poll->url;
    char path[256];
    int  count;
    int  i;
-   const char *space = "0";
+   const char *space = "";
 
    status = echttp_redirected("GET");
    if (!status) {
        echttp_submit (0, 0, housedvr_feed_scanned, origin);
        return;
    }
+   housedvr_feed_done (poll);
 
    if (status != 200) {
        houselog_trace (HOUSE_FAILURE, server, "HTTP error %d", status);
@@ -381,7 +659,7 @@ static void housedvr_feed_scanned
        space = Tokens[available].value.string;
    }
 
-   if (housedvr_feed_server (feedname, updated, adminweb, space)) {
+   if (housedvr_feed_server (feedname, updated, adminweb, server, space)) {
        houselog_event ("CCTV", feedname, "ADDED", "ADMIN %s", adminweb);
    }
 
@@ -424,48 +702,107 @@ static void housedvr_feed_scanned
    int records = echttp_json_search (Tokens, ".cctv.recordings");
    if (records <= 0) return;
 
+   // The recordings that are not more recent than the "since" cursor used
+   // for this scan (if any) were already handled: skip them.
+   // Calculate the new cursor: the most recent recording time such that
+   // no recording that was skipped (unstable, or rejected) is older.
+   //
+   ServerRegistration *source = housedvr_feed_byurl (server);
+   long long since = source ? source->since : 0;
+   int urgent = source ? housedvr_feed_urgent (source) : 0;
+   long long newest = since;
+   long long blocked = LLONG_MAX;
+   int usable = 1;
+
+   // Walk the list of recordings once, using the child indexes, instead
+   // of searching for each recording and each field from the list start.
+   //
+   n = Tokens[records].length;
+   if (n <= 0) return;
+   error = echttp_json_enumerate (Tokens+records, InnerList);
+   if (error) {
+       houselog_trace (HOUSE_FAILURE, server, "%s", error);
+       return;
+   }
+
    time_t now = time(0);
-   for (n = Tokens[records].length - 1; n >= 0; --n) {
-       char jsonpath[64];
-       snprintf (jsonpath, sizeof(jsonpath), "[%d]", n);
-       int file = echttp_json_search (Tokens+records, jsonpath);
-       if (file <= 0) continue;
-       ParserToken *fileinfo = Tokens + records + file;
+   for (i = n - 1; i >= 0; --i) {
+       int field[16];
+       ParserToken *fileinfo = Tokens + records + InnerList[i];
        if (fileinfo->type != PARSER_ARRAY) continue;
        if (fileinfo->length < 3) continue;
-
-       int filepath = echttp_json_search (fileinfo, "[1]");
-       if (filepath <= 0) continue;
-       if (fileinfo[filepath].type != PARSER_STRING) continue;
-       int size = echttp_json_search (fileinfo, "[2]");
-       if (size <= 0) continue;
-       if (fileinfo[size].type != PARSER_INTEGER) continue;
+       if (fileinfo->length > 16) continue; // Not a valid recording.
+       if (echttp_json_enumerate (fileinfo, field)) continue;
+
+       ParserToken *filepath = fileinfo + field[1];
+       if (filepath->type != PARSER_STRING) continue;
+       ParserToken *size = fileinfo + field[2];
+       if (size->type != PARSER_INTEGER) continue;
+
+       long long recorded = -1;
+       ParserToken *timeitem = fileinfo + field[0];
+       if (timeitem->type == PARSER_INTEGER) {
+           recorded = timeitem->value.integer;
+           if (recorded <= since) continue; // Already handled.
+           if (recorded > newest) newest = recorded;
+       } else {
+           usable = 0; // Cannot rely on a cursor for this service.
+       }
 
        int stable = 0;
        if (fileinfo->length >= 4) {
-           int stableitem = echttp_json_search (fileinfo, "[3]");
-           if ((stableitem > 0) && (fileinfo[stableitem].type == PARSER_BOOL))
-               stable = fileinfo[stableitem].value.bool;
-       } else {
-           int timeitem = echttp_json_search (fileinfo, "[0]");
-           if ((timeitem > 0) && (fileinfo[timeitem].type == PARSER_INTEGER)) {
-               time_t ts = (time_t)(fileinfo[timeitem].value.integer);
-               if (ts < now - 60) stable = 1;
-           }
+           ParserToken *stableitem = fileinfo + field[3];
+           if (stableitem->type == PARSER_BOOL)
+               stable = stableitem->value.bool;
+       } else if (recorded >= 0) {
+           if ((time_t)recorded < now - 60) stable = 1;
        }
        if (stable) {
-           int r = housedvr_transfer_notify (origin,
-                                             fileinfo[filepath].value.string,
-                                             (int)(fileinfo[size].value.integer));
-           if (!r) HouseFeedNextFullScan = now + 10; // Rush a full scan soon.
+           // A recording without time gets the lowest priority.
+           int r = housedvr_transfer_notify (server,
+                                             filepath->value.string,
+                                             (int)(size->value.integer),
+                                             (recorded < 0) ? 0 : recorded,
+                                             urgent);
+           if (!r) {
+               poll->fullscan = now + 10; // Rush a full scan soon.
+               stable = 0; // Not handled.
+           }
+       }
+       if ((!stable) && (recorded >= 0) && (recorded < blocked))
+           blocked = recorded;
+   }
+
+   // Poll this service more often when it produced new recordings.
+   //
+   if (source && newest > source->cursor) poll->interval = HOUSE_FEED_FAST;
+
+   if (source) {
+       if (!usable) {
+           source->cursor = 0;
+       } else if (blocked <= newest) {
+           source->cursor = blocked - 1;
+       } else {
+           source->cursor = newest;
        }
    }
 }
 
-static void housedvr_feed_scan (const char *serverurl) {
+static void housedvr_feed_scan (PollSchedule *poll, int full) {
 
-   char url[256];
-   snprintf (url, sizeof(url), "%s/status", serverurl);
+   const char *serverurl = poll->url;
+   char url[sizeof(poll->url) + 64];
+
+   // Use the cursor only for an incremental scan.
+   //
+   ServerRegistration *source = housedvr_feed_byurl (serverurl);
+   if (source) source->since = full ? 0 : source->cursor;
+
+   if (source && source->since > 0)
+       snprintf (url, sizeof(url),
+                 "%s/status?since=%lld", serverurl, source->since);
+   else
+       snprintf (url, sizeof(url), "%s/status", serverurl);
 
    DEBUG ("Attempting status collection at %s\n", url);
    const char *error = echttp_client ("GET", url);
@@ -473,13 +810,19 @@ static void housedvr_feed_scan (const char *serverurl) {
        houselog_trace (HOUSE_FAILURE, serverurl, "%s", error);
        return;
    }
-   echttp_submit (0, 0, housedvr_feed_scanned, (void *)serverurl);
+   echttp_submit (0, 0, housedvr_feed_scanned, housedvr_feed_tag (poll));
+   poll->inflight = time(0);
+   HouseFeedInFlight += 1;
+   housedvr_host_connect (poll->host);
 }
 
 static void housedvr_feed_checked
                (void *origin, int status, char *data, int length) {
 
-   const char *serverurl = (const char *) origin;
+   PollSchedule *poll = housedvr_feed_untag (origin);
+   if (!poll) return; // Stale response, the poll was declared lost.
+
+   const char *serverurl = poll->url;
    ParserToken tokens[32];
    int  count = 32;
 
@@ -488,11 +831,16 @@ static void housedvr_feed_checked
        echttp_submit (0, 0, housedvr_feed_checked, origin);
        return;
    }
+   housedvr_feed_done (poll);
 
    if (status != 200) {
        houselog_trace (HOUSE_FAILURE, serverurl, "HTTP error %d", status);
-       // If the target service does not support /check, force a status scan.
-       if (status == 401) housedvr_feed_scan (serverurl);
+       // If the target service does not support /check, force a status scan
+       // at the next poll, within the limits of concurrent polls.
+       if (status == 401) {
+           poll->fullscan = 0;
+           poll->deadline = 0;
+       }
        return;
    }
 
@@ -523,17 +871,22 @@ static void housedvr_feed_checked
    }
    if (housedvr_feed_uptodate (feedname, tokens[stamp].value.integer)) {
        housedvr_feed_refresh (feedname);
+       // Nothing changed: back off, up to the longest interval.
+       poll->interval += poll->interval / 2;
+       if (poll->interval > HOUSE_FEED_SLOW) poll->interval = HOUSE_FEED_SLOW;
    } else {
        // If the update stamp did not match the last known one, if any,
        // it is time to fetch the status of this very server.
        //
-       housedvr_feed_scan (serverurl);
+       poll->interval = HouseFeedCheckPeriod;
+       housedvr_feed_scan (poll, 0);
    }
 }
 
-static void housedvr_feed_check (const char *serverurl) {
+static void housedvr_feed_check (PollSchedule *poll) {
 
-    char url[256];
+    const char *serverurl = poll->url;
+    char url[sizeof(poll->url) + 64];
 
     snprintf (url, sizeof(url), "%s/check", serverurl);
 
@@ -543,20 +896,104 @@ static void housedvr_feed_check (const char *serverurl) {
         houselog_trace (HOUSE_FAILURE, serverurl, "%s", error);
         return;
     }
-    echttp_submit (0, 0, housedvr_feed_checked, (void *)serverurl);
+    echttp_submit (0, 0, housedvr_feed_checked, housedvr_feed_tag (poll));
+    poll->inflight = time(0);
+    HouseFeedInFlight += 1;
+    housedvr_host_connect (poll->host);
+}
+
+// Return the polling schedule of the specified CCTV service, or -1.
+//
+static int housedvr_feed_pollbyurl (const char *serverurl,
+                                    unsigned int signature) {
+
+    int i = PollsByUrl[signature & (HOUSE_FEED_BUCKETS - 1)];
+    while (i >= 0) {
+        if (Polls[i]->signature == signature) {
+            if (!strcmp (serverurl, Polls[i]->url)) break;
+        }
+        i = Polls[i]->next;
+    }
+    return i;
 }
 
-static void housedvr_feed_poll
+// Record each discovered CCTV service in the polling schedule. A new
+// service is polled first after a delay derived from its URL, within its
+// poll interval, so that the services discovered at the same time are
+// spread over that interval.
+//
+static void housedvr_feed_discovered
                 (const char *service, void *context, const char *serverurl) {
 
     time_t now = *((time_t *)context);
 
-    if (now < HouseFeedNextFullScan) {
-        housedvr_feed_check (serverurl);
-    } else {
-        housedvr_feed_scan (serverurl);
+    unsigned int signature = echttp_hash_signature (serverurl);
+    int i = housedvr_feed_pollbyurl (serverurl, signature);
+
+    if (i < 0) {
+        if (PollsCount >= PollsSize) {
+            PollsSize += 16;
+            Polls = realloc (Polls, PollsSize * sizeof(PollSchedule *));
+            if (!Polls) crashandburn();
+        }
+        PollSchedule *poll = calloc (1, sizeof(PollSchedule));
+        if (!poll) crashandburn();
+        snprintf (poll->url, sizeof(poll->url), "%s", serverurl);
+        poll->signature = signature;
+        poll->interval = HouseFeedCheckPeriod;
+        poll->deadline = now + (signature % poll->interval);
+        poll->fullscan = 0; // The first poll is always a full scan.
+        poll->host = housedvr_host_find (serverurl);
+
+        i = PollsCount++;
+        Polls[i] = poll;
+        poll->id = i;
+        poll->next = PollsByUrl[signature & (HOUSE_FEED_BUCKETS - 1)];
+        PollsByUrl[signature & (HOUSE_FEED_BUCKETS - 1)] = i;
+        DEBUG ("CCTV service %s first poll in %d seconds\n",
+               serverurl, (int)(poll->deadline - now));
+    } else if (Polls[i]->seen < now - (3 * HouseFeedCheckPeriod)) {
+        // A service that comes back after an outage: resync fast.
+        Polls[i]->interval = HouseFeedCheckPeriod;
+        Polls[i]->deadline = now + (signature % Polls[i]->interval);
+        Polls[i]->fullscan = 0;
+    }
+    Polls[i]->seen = now;
+}
+
+// Poll the CCTV services that are due, within the limit of concurrent
+// polls. A service that was not discovered recently is not polled.
+//
+static void housedvr_feed_poll (time_t now) {
+
+    int i;
+    time_t lost = now - HOUSE_FEED_TIMEOUT;
+    time_t gone = now - (3 * HouseFeedCheckPeriod);
+
+    for (i = 0; i < PollsCount; ++i) {
+        PollSchedule *poll = Polls[i];
+        if (poll->inflight) {
+            if (poll->inflight >= lost) continue;
+            DEBUG ("Poll of %s lost\n", poll->url);
+            housedvr_feed_done (poll); // No response: forget about it.
+        }
+        if (poll->deadline > now) continue;
+        if (poll->seen < gone) continue;
+        if (HouseFeedInFlight >= HouseFeedMaxPolls) return;
+        if (housedvr_host_busy (poll->host, 1)) continue; // Try again later.
+
+        if (now >= poll->fullscan) {
+            housedvr_feed_scan (poll, 1);
+            poll->fullscan = now + HOUSE_FEED_FULLSCAN
+                                 + (rand() % HOUSE_FEED_FAST);
+        } else {
+            housedvr_feed_check (poll);
+        }
+        int interval = poll->interval;
+        if (poll->notified + HOUSE_FEED_PUSHED > now)
+            interval = HOUSE_FEED_SLOW;
+        poll->deadline = now + interval + (rand() % (interval / 5 + 1));
     }
-    HouseFeedPolled += 1;
 }
 
 // LEGACY feed discovery: the video feed servers periodically call the DVR
@@ -582,7 +1019,7 @@ static const char *dvr_feed_declare (const char *method,
         int j = 0;
 
         snprintf (devurl, sizeof(devurl), "http://%s/", admin);
-        if (housedvr_feed_server (name, 0, devurl, space)) {
+        if (housedvr_feed_server (name, 0, devurl, "", space)) {
             houselog_event ("CCTV", name, "ADDED", "ADMIN %s", devurl);
         }
 
@@ -610,33 +1047,68 @@ static const char *dvr_feed_declare (const char *method,
     return "";
 }
 
-int housedvr_feed_status (char *buffer, int size) {
+// Push notification: a CCTV service reports a recording that it just
+// completed, so that it can be transferred without waiting for the next
+// poll. Only the services that were discovered can notify, and the file
+// is always fetched from the service's known URL. The periodic polls
+// remain the backstop if a notification is lost or rejected.
+//
+static const char *dvr_feed_notify (const char *method,
+                                    const char *uri,
+                                    const char *data, int length) {
+
+    const char *host = echttp_parameter_get("host");
+    const char *path = echttp_parameter_get("path");
+    const char *size = echttp_parameter_get("size");
+    const char *stable = echttp_parameter_get("stable");
+    const char *recorded = echttp_parameter_get("time");
+
+    if ((!host) || (!path) || (!size)) {
+        echttp_error (400, "missing parameter");
+        return "";
+    }
+    int i = housedvr_feed_find (host);
+    if ((i < 0) || (!Servers[i].timestamp) || (!Servers[i].url[0])) {
+        echttp_error (404, "Unknown CCTV service");
+        return "";
+    }
+    if (stable && strcmp (stable, "true") && strcmp (stable, "1")) {
+        return ""; // Not ready yet: the next poll will report it.
+    }
+    time_t now = time(0);
+    int poll = housedvr_feed_pollbyurl (Servers[i].url, Servers[i].urlsignature);
+    if (poll >= 0) Polls[poll]->notified = now; // Poll this service less.
+
+    long long when = recorded ? atoll(recorded) : (long long)now;
+    if (!housedvr_transfer_notify (Servers[i].url, path, atoi(size),
+                                   when, housedvr_feed_urgent (Servers + i))) {
+        echttp_error (503, "Transfer queue full");
+    }
+    return "";
+}
+
+static void housedvr_feed_build (HouseDvrBuffer *output) {
 
     int i;
-    int cursor = 0;
     const char *prefix = "";
 
-    cursor = snprintf (buffer, size, "\"servers\":[");
-    if (cursor >= size) goto overflow;
+    housedvr_buffer_reset (output);
+    housedvr_buffer_printf (output, "\"servers\":[");
 
     for (i = 0; i < ServersCount; ++i) {
  
         if (!Servers[i].timestamp) continue;
 
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s{\"name\":\"%s\",\"url\":\"%s\""
-                                ",\"space\":\"%d MB\",\"timestamp\":%ld}",
-                            prefix, Servers[i].name, Servers[i].adminurl,
-                            Servers[i].available,
-                            (long)(Servers[i].timestamp));
-        if (cursor >= size) goto overflow;
+        housedvr_buffer_printf (output,
+                                "%s{\"name\":\"%s\",\"url\":\"%s\""
+                                    ",\"space\":\"%d MB\",\"timestamp\":%ld}",
+                                prefix, Servers[i].name, Servers[i].adminurl,
+                                (Servers[i].available < 0) ?
+                                    0 : Servers[i].available,
+                                (long)(Servers[i].timestamp));
         prefix = ",";
     }
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    if (cursor >= size) goto overflow;
-
-    cursor += snprintf (buffer+cursor, size-cursor, ",\"feed\":[");
-    if (cursor >= size) goto overflow;
+    housedvr_buffer_printf (output, "],\"feed\":[");
     prefix = "";
 
     for (i = 0; i < FeedsCount; ++i) {
@@ -644,40 +1116,63 @@ int housedvr_feed_status (char *buffer, int size) {
         if (!Feeds[i].timestamp) continue;
         if (!Feeds[i].name) continue;
 
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s{\"name\":\"%s\",\"url\":\"%s\""
-                                ",\"timestamp\":%lld}",
-                            prefix, Feeds[i].name, Feeds[i].url,
-                                (long long)(Feeds[i].timestamp));
-        if (cursor >= size) goto overflow;
+        housedvr_buffer_printf (output,
+                                "%s{\"name\":\"%s\",\"url\":\"%s\""
+                                    ",\"timestamp\":%lld}",
+                                prefix, Feeds[i].name, Feeds[i].url,
+                                    (long long)(Feeds[i].timestamp));
         prefix = ",";
     }
+    housedvr_buffer_printf (output, "]");
+}
 
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    if (cursor >= size) goto overflow;
+void housedvr_feed_status (HouseDvrBuffer *output) {
 
-    return cursor;
+    static HouseDvrBuffer Cache;
+    static int CacheGeneration = -1;
 
-overflow:
-    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
-    echttp_error (413, "Payload too large");
-    buffer[0] = 0;
-    return 0;
+    if (CacheGeneration != HouseFeedGeneration) {
+        housedvr_feed_build (&Cache);
+        CacheGeneration = HouseFeedGeneration;
+    }
+    housedvr_buffer_append (output, Cache.data, Cache.length);
 }
 
 void housedvr_feed_initialize (int argc, const char **argv) {
 
     int i;
     const char *period = 0;
+    const char *polls = 0;
+    const char *urgent = 0;
     for (i = 1; i < argc; ++i) {
         echttp_option_match ("-dvr-feed=", argv[i], &HouseFeedService);
         echttp_option_match ("-dvr-check=", argv[i], &period);
+        echttp_option_match ("-dvr-polls=", argv[i], &polls);
+        echttp_option_match ("-dvr-urgent=", argv[i], &urgent);
     }
-    if (period)
+    if (urgent) HouseFeedUrgentSpace = atoi(urgent);
+    if (period) {
         HouseFeedCheckPeriod = atoi(period);
+        if (HouseFeedCheckPeriod < HOUSE_FEED_FAST)
+            HouseFeedCheckPeriod = HOUSE_FEED_FAST;
+        else if (HouseFeedCheckPeriod > HOUSE_FEED_SLOW)
+            HouseFeedCheckPeriod = HOUSE_FEED_SLOW;
+    }
+    if (polls) {
+        HouseFeedMaxPolls = atoi(polls);
+        if (HouseFeedMaxPolls < 1) HouseFeedMaxPolls = 1;
+    }
+
+    for (i = 0; i < HOUSE_FEED_BUCKETS; ++i) {
+        ServersByName[i] = ServersByUrl[i] = FeedsByName[i] = -1;
+        PollsByUrl[i] = -1;
+    }
 
     // Support the legacy mode (each server declares its video feeds):
-    echttp_route_uri ("/dvr/source/declare", dvr_feed_declare);
+    housedvr_metrics_route ("/dvr/source/declare", dvr_feed_declare);
+
+    // Let the CCTV services push their new recordings:
+    housedvr_metrics_route ("/dvr/source/notify", dvr_feed_notify);
 }
 
 void housedvr_feed_background (time_t now) {
@@ -685,41 +1180,38 @@ void housedvr_feed_background (time_t now) {
     static time_t StartPeriodEnd = 0;
     static time_t NextCleanup = 0;
     static time_t NextDiscovery = 0;
+    static time_t LastPoll = 0;
 
     if (!now) { // This is a manual reset (force a discovery refresh)
         StartPeriodEnd = 0;
         NextDiscovery = 0;
         return;
     }
+    if (now == LastPoll) return;
+    LastPoll = now;
 
-    // Poll every 10s for the first minute, then poll every 30 seconds.
+    // Discover every 10s for the first minute, then every check period.
     // The fast start is to make the whole network recover fast from
     // an outage, when we do not know in which order the systems start.
     // Later on, there is no need to create more traffic.
     // The timing of the pruning mechanism is not impacted.
     //
     if (StartPeriodEnd == 0) StartPeriodEnd = now + 60;
-    if ((now <= NextCleanup) && (now < HouseFeedNextFullScan)) return;
-    NextCleanup = now + 10;
-
-    housedvr_feed_prune (now);
-
-    if (now < HouseFeedNextFullScan) {
-        if (now <= NextDiscovery && now >= StartPeriodEnd) return;
+    if (now > NextCleanup) {
+        NextCleanup = now + 10;
+        housedvr_feed_prune (now);
     }
-    NextDiscovery = now + HouseFeedCheckPeriod;
 
-    DEBUG ("Proceeding with discovery of service %s\n", HouseFeedService);
-    HouseFeedPolled = 0;
-    housediscovered (HouseFeedService, &now, housedvr_feed_poll);
-
-    if (HouseFeedPolled) {
-        if (now >= HouseFeedNextFullScan) {
-            HouseFeedNextFullScan = now + 300; // Next full scan in 5 minutes.
-        }
-    } else if (HouseFeedNextFullScan > 0) {
-        // We lost contact with all CCTV servers. Time to resync.
-        HouseFeedNextFullScan = 0;
+    if (now >= NextDiscovery) {
+        if (now < StartPeriodEnd)
+            NextDiscovery = now + HOUSE_FEED_FAST;
+        else
+            NextDiscovery = now + HouseFeedCheckPeriod;
+        DEBUG ("Proceeding with discovery of service %s\n", HouseFeedService);
+        housediscovered (HouseFeedService, &now, housedvr_feed_discovered);
     }
-}
 
+    // The polls themselves are driven by each service's own schedule.
+    //
+    housedvr_feed_poll (now);
+}
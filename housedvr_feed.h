@@ -24,6 +24,6 @@
 void housedvr_feed_initialize (int argc, const char **argv);
 void housedvr_feed_background (time_t now);
 
-int  housedvr_feed_status (char *buffer, int size);
+void housedvr_feed_status (HouseDvrBuffer *output);
 int  housedvr_feed_list (char *buffer, int size);
 
@@ -0,0 +1,161 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedvr_host.c - Limit the HTTP connections to each CCTV host.
+ *
+ * SYNOPSYS:
+ *
+ * This module limits the number of concurrent HTTP requests sent to the
+ * same host, shared by the polls of the CCTV services (housedvr_feed.c)
+ * and the transfers of recordings (housedvr_transfer.c). The HTTP client
+ * in echttp opens a new connection for each request, and does not keep
+ * connections alive: each request to a CCTV service is a new TCP (and
+ * possibly TLS) handshake. Capping the requests in flight for each host
+ * keeps a busy host from receiving bursts of handshakes, for example
+ * when a poll, several transfers and the poll of another CCTV service on
+ * the same machine all start within the same second. The requests that
+ * would exceed the limit just wait for a later second. One request is
+ * always reserved for the polls, so that a host busy with a transfer
+ * backlog is still polled: otherwise its services would be pruned.
+ *
+ * A host is identified by the scheme, name and port of the URL, so that
+ * multiple CCTV services running on the same machine share one limit.
+ * The limit is set using the -dvr-host-connections=N option (default 4).
+ *
+ * void housedvr_host_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * int housedvr_host_find (const char *url);
+ *
+ *    Return the identifier of the host for the specified URL.
+ *
+ * int housedvr_host_busy (int host, int poll);
+ *
+ *    Return 1 if no new request to the specified host may start. The
+ *    poll flag tells if the request is a poll (1) or a transfer (0).
+ *
+ * void housedvr_host_connect (int host);
+ * void housedvr_host_disconnect (int host);
+ *
+ *    Record that a request to the specified host has started, or ended.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <echttp.h>
+#include <echttp_hash.h> // Just for the signature.
+
+#include "housedvr_host.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+// The hosts, indexed by an hash table with chaining. The CCTV hosts come
+// and go rarely, so entries are never removed.
+//
+#define HOST_HASH 64 // Must be a power of 2.
+
+typedef struct {
+    char name[128];
+    unsigned int signature;
+    int next;
+    int inflight;
+} HostConnections;
+
+static HostConnections *Hosts = 0;
+static int              HostsCount = 0;
+static int              HostsSize = 0;
+
+static int HostsByName[HOST_HASH];
+
+static int HostMaxConnections = 4;
+
+
+int housedvr_host_find (const char *url) {
+
+    // Keep only the scheme, host name and port.
+    char name[128];
+    const char *start = strstr (url, "://");
+    start = start ? start + 3 : url;
+    const char *end = strchr (start, '/');
+    int length = end ? (int)(end - url) : (int)strlen (url);
+    if (length >= sizeof(name)) length = sizeof(name) - 1;
+    snprintf (name, sizeof(name), "%.*s", length, url);
+
+    unsigned int signature = echttp_hash_signature (name);
+    int *bucket = HostsByName + (signature & (HOST_HASH - 1));
+
+    int i;
+    for (i = *bucket; i >= 0; i = Hosts[i].next) {
+        if (Hosts[i].signature != signature) continue;
+        if (!strcmp (Hosts[i].name, name)) return i;
+    }
+
+    if (HostsCount >= HostsSize) {
+        HostsSize += 16;
+        Hosts = realloc (Hosts, HostsSize * sizeof(HostConnections));
+        if (!Hosts) {
+            HostsCount = HostsSize = 0;
+            return -1;
+        }
+    }
+    i = HostsCount++;
+    memset (Hosts + i, 0, sizeof(HostConnections));
+    snprintf (Hosts[i].name, sizeof(Hosts[i].name), "%s", name);
+    Hosts[i].signature = signature;
+    Hosts[i].next = *bucket;
+    *bucket = i;
+    DEBUG ("New CCTV host %s\n", name);
+    return i;
+}
+
+int housedvr_host_busy (int host, int poll) {
+
+    if ((host < 0) || (host >= HostsCount)) return 0;
+    int limit = poll ? HostMaxConnections : HostMaxConnections - 1;
+    return Hosts[host].inflight >= limit;
+}
+
+void housedvr_host_connect (int host) {
+
+    if ((host < 0) || (host >= HostsCount)) return;
+    Hosts[host].inflight += 1;
+}
+
+void housedvr_host_disconnect (int host) {
+
+    if ((host < 0) || (host >= HostsCount)) return;
+    if (Hosts[host].inflight > 0) Hosts[host].inflight -= 1;
+}
+
+void housedvr_host_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *connections = 0;
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-dvr-host-connections=", argv[i], &connections);
+    }
+    if (connections) HostMaxConnections = atoi (connections);
+    if (HostMaxConnections < 2) HostMaxConnections = 2; // self protection
+
+    for (i = 0; i < HOST_HASH; ++i) HostsByName[i] = -1;
+}
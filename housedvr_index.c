@@ -0,0 +1,1310 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedvr_index.c - An in-memory index of the stored recordings.
+ *
+ * SYNOPSYS:
+ *
+ * This module keeps track of which recordings are already stored, and
+ * their size, so that checking if a reported recording must be transferred
+ * does not require any access to the file system.
+ *
+ * The index is built once at startup by walking the storage tree, and
+ * then maintained by the transfer module (new recordings) and the store
+ * module (deleted days).
+ *
+ * The recordings may be stored on two tiers: the main storage, where the
+ * new recordings are written, and the archive, where the store module
+ * migrates the older recordings. Both follow the same directory structure
+ * and the index merges them, remembering which tier each recording is on.
+ *
+ * If the -dvr-index=PATH option is used, the index is periodically saved
+ * to the specified file. At startup, the content of each day directory
+ * that did not change since the last save is loaded from that file,
+ * instead of being read from the storage. Only the year, month and day
+ * directories are accessed in that case. The snapshot text of each day is
+ * kept in memory and rebuilt only after that day changed, and the file is
+ * written by a helper thread, so that a save does not stall the web server.
+ *
+ * The index also maintains the total size of the recordings, per day and
+ * per source (the camera name found in the file name), as well as the
+ * amount of data added since startup, so that the disk cleanup can plan
+ * ahead without accessing the file system. The recordings of each source
+ * are also kept in chronological order, so that the oldest recording of
+ * a camera can be found immediately.
+ *
+ * This module also maintains a calendar of the existing year, month and
+ * day directories, so that the web requests used to navigate the storage
+ * can be answered without accessing the file system.
+ *
+ * All paths are relative to the storage root, and are expected to follow
+ * the YYYY/MM/DD/name convention.
+ *
+ * void housedvr_index_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module and load the index from the storage tree.
+ *    This must be called after the store module was initialized.
+ *
+ * void housedvr_index_background (time_t now);
+ *
+ *    Save the index snapshot periodically, if it changed.
+ *
+ * long long housedvr_index_size (const char *path);
+ *
+ *    Return the size of the stored file, or -1 if the file is not stored.
+ *
+ * void housedvr_index_add (const char *path, long long size);
+ *
+ *    Record that a file was stored (or updated).
+ *
+ * void housedvr_index_digest_set (const char *path, unsigned int digest);
+ * unsigned int housedvr_index_digest (const char *path);
+ *
+ *    Record, or return, the checksum (CRC32C) of the content of a stored
+ *    file. The checksum is known only for the files transferred since it
+ *    was introduced: 0 means unknown. It is forgotten when the size of
+ *    the file changes.
+ *
+ * void housedvr_index_forget (int year, int month, int day);
+ *
+ *    Remove all the files of the specified day from the index. This is
+ *    used when the day directory is deleted. If day is 0, the whole month
+ *    is removed from the calendar, and if month is 0, the whole year.
+ *
+ * void housedvr_index_calendar_add (const char *path);
+ *
+ *    Record that the year, month and day directories for this path exist.
+ *    The path may stop at the year or month level.
+ *
+ * void housedvr_index_delete (const char *path);
+ *
+ *    Record that a single file was deleted.
+ *
+ * int housedvr_index_oldest (void);
+ *
+ *    Return the date (YYYYMMDD) of the oldest day in the index, or 0 if
+ *    the index is empty. That day may not have any recording left.
+ *
+ * const char *housedvr_index_first (int date, long long *size);
+ *
+ *    Return the path and size of the oldest recording for the specified
+ *    day (YYYYMMDD), or 0 if there is no recording left for that day.
+ *    The path returned is only valid until the index is modified.
+ *
+ * int housedvr_index_tier (const char *path);
+ *
+ *    Return the tier of the specified recording: 0 for the main storage,
+ *    1 for the archive, or -1 if the recording is not indexed.
+ *
+ * void housedvr_index_archived (const char *path);
+ *
+ *    Record that a recording was moved to the archive.
+ *
+ * int housedvr_index_unarchived (int after, int before);
+ *
+ *    Return the date (YYYYMMDD) of the oldest day, between the two
+ *    specified (excluded), that has recordings on the main storage, or
+ *    0 if none. Use 0 as the after date to start from the oldest day.
+ *
+ * const char *housedvr_index_first_tier (int date, int tier, long long *size);
+ *
+ *    Return the path and size of the oldest recording of the specified
+ *    day on the specified tier, or 0 if there is none.
+ *
+ * long long housedvr_index_total (int date);
+ *
+ *    Return the total size of the recordings for the specified day
+ *    (YYYYMMDD), or for all days if date is 0.
+ *
+ * long long housedvr_index_ingested (void);
+ *
+ *    Return the total size of the recordings added since startup. This
+ *    never decreases, and is used to measure the ingest rate.
+ *
+ * int housedvr_index_source_find (const char *name);
+ *
+ *    Return the identifier of the specified source, or -1 if no recording
+ *    from that source was ever indexed. A source identifier never changes.
+ *
+ * const char *housedvr_index_source_first (int source, long long *size);
+ * long long housedvr_index_source_total (int source);
+ *
+ *    Return the path and size of the oldest recording from the specified
+ *    source (or 0 if there is none), and the total size of the recordings
+ *    from that source. The path returned is only valid until the index is
+ *    modified.
+ *
+ * const char *housedvr_index_enumerate (int source, int from,
+ *                                      long long *cursor, long long *size);
+ *
+ *    Enumerate the recordings in chronological order, starting with the
+ *    day (YYYYMMDD) specified. If source is not -1, only the recordings
+ *    from that source are returned. The cursor must be 0 on the first
+ *    call, and is updated on each call. Return the path and size of the
+ *    next recording, or 0 when there is none left. The index must not be
+ *    modified between calls.
+ *
+ * void housedvr_index_status (HouseDvrBuffer *output);
+ *
+ *    Append the storage usage per source, in JSON.
+ *
+ * int housedvr_index_generation (int year, int month, int day);
+ *
+ *    Return a number that changes each time a recording is added to, or
+ *    updated in, the specified day, or 0 if the day has no recording.
+ *    This is used to detect when cached information about a day is stale.
+ *
+ * int housedvr_index_years (int *years, int size);
+ * unsigned int housedvr_index_months (int year);
+ * unsigned int housedvr_index_days (int year, int month);
+ *
+ *    Return the calendar: the list of existing years (sorted, the return
+ *    value is the count), a bitmap of the existing months (bit 1 to 12) in
+ *    one year, and a bitmap of the existing days (bit 1 to 31) in a month.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <echttp.h>
+#include <echttp_hash.h> // Just for the signature.
+
+#include "houselog.h"
+
+#include "housedvr_buffer.h"
+#include "housedvr_store.h"
+#include "housedvr_index.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+// The recordings are stored in a single table, which can grow but never
+// shrinks. A free entry has a null path, and is chained in the free list.
+// The entries are found using a hash table (with chaining, using the same
+// next field), where each bucket is the index of the first entry, or -1.
+//
+typedef struct {
+    char *path;
+    unsigned int signature;
+    long long size;
+    unsigned int digest; // CRC32C of the content, 0 if unknown.
+    int source;
+    int tier;
+    int next;
+} IndexRecording;
+
+static IndexRecording *IndexRecordings = 0;
+static int IndexRecordingsCount = 0;
+static int IndexRecordingsSize = 0;
+static int IndexRecordingsFree = -1;
+
+static int *IndexBuckets = 0;
+static int  IndexBucketsSize = 0; // Always a power of 2.
+
+// The recordings are also organized by day, so that all the files in
+// a deleted day can be removed from the index at once. The list of days
+// is sorted by date, and each day keeps its recordings sorted by name.
+//
+typedef struct {
+    int date; // YYYYMMDD
+    int generation;
+    int count;
+    int size;
+    int unarchived; // Number of recordings on the main storage.
+    long long bytes;
+    int *recordings;
+    int saved; // The generation of the snapshot text below.
+    HouseDvrBuffer snapshot[2]; // The snapshot text, for each tier.
+} IndexDay;
+
+static IndexDay *IndexDays = 0;
+static int IndexDaysCount = 0;
+static int IndexDaysSize = 0;
+
+static int IndexGeneration = 0;
+
+// The sources of the recordings. There are only a few cameras, and
+// their list never shrinks, so a short linear search is good enough.
+//
+// The recordings of a source are listed in chronological (name) order,
+// starting at the start offset: the oldest recording, which is the one
+// most likely to be deleted, is removed without moving the others.
+//
+typedef struct {
+    char *name;
+    unsigned int signature;
+    int count;
+    int start;
+    int size;
+    int *recordings;
+    long long bytes;
+} IndexSource;
+
+static IndexSource *IndexSources = 0;
+static int IndexSourcesCount = 0;
+static int IndexSourcesSize = 0;
+
+static long long IndexTotal = 0;
+static long long IndexIngested = 0;
+static int IndexStarted = 0;
+
+// The calendar is a sorted list of years, each with a bitmap of months
+// and a bitmap of days for each month.
+//
+typedef struct {
+    int year;
+    unsigned int months;
+    unsigned int days[13];
+} IndexYear;
+
+static IndexYear *IndexYears = 0;
+static int IndexYearsCount = 0;
+static int IndexYearsSize = 0;
+
+
+static IndexYear *housedvr_index_year (int year, int create) {
+
+    int i;
+    for (i = 0; i < IndexYearsCount; ++i) {
+        if (IndexYears[i].year == year) return IndexYears + i;
+        if (IndexYears[i].year > year) break;
+    }
+    if (!create) return 0;
+
+    if (IndexYearsCount >= IndexYearsSize) {
+        IndexYearsSize += 16;
+        IndexYears = realloc (IndexYears, IndexYearsSize * sizeof(IndexYear));
+    }
+    memmove (IndexYears + i + 1, IndexYears + i,
+             (IndexYearsCount - i) * sizeof(IndexYear));
+    IndexYearsCount += 1;
+
+    IndexYear *new = IndexYears + i;
+    memset (new, 0, sizeof(IndexYear));
+    new->year = year;
+    return new;
+}
+
+static void housedvr_index_mark (int year, int month, int day) {
+
+    IndexYear *entry = housedvr_index_year (year, 1);
+    if ((month < 1) || (month > 12)) return;
+    entry->months |= (1u << month);
+    if ((day < 1) || (day > 31)) return;
+    entry->days[month] |= (1u << day);
+}
+
+void housedvr_index_calendar_add (const char *path) {
+
+    int year, month = 0, day = 0;
+    if (sscanf (path, "%4d/%2d/%2d", &year, &month, &day) < 1) return;
+    housedvr_index_mark (year, month, day);
+}
+
+int housedvr_index_years (int *years, int size) {
+
+    int i;
+    for (i = 0; (i < IndexYearsCount) && (i < size); ++i) {
+        years[i] = IndexYears[i].year;
+    }
+    return i;
+}
+
+unsigned int housedvr_index_months (int year) {
+
+    IndexYear *entry = housedvr_index_year (year, 0);
+    return entry ? entry->months : 0;
+}
+
+unsigned int housedvr_index_days (int year, int month) {
+
+    IndexYear *entry = housedvr_index_year (year, 0);
+    if ((!entry) || (month < 1) || (month > 12)) return 0;
+    return entry->days[month];
+}
+
+static int housedvr_index_date (const char *path, const char **name) {
+
+    int year, month, day;
+    int length = 0;
+    if (sscanf (path, "%4d/%2d/%2d/%n", &year, &month, &day, &length) < 3)
+        return 0;
+    if (length <= 0) return 0;
+    if (name) *name = path + length;
+    return (year * 10000) + (month * 100) + day;
+}
+
+int housedvr_index_source_find (const char *name) {
+
+    unsigned int signature = echttp_hash_signature (name);
+    int i;
+    for (i = 0; i < IndexSourcesCount; ++i) {
+        if (IndexSources[i].signature != signature) continue;
+        if (!strcmp (IndexSources[i].name, name)) return i;
+    }
+    return -1;
+}
+
+// Find the source of a recording from its name, which follows the
+// TIME-SOURCE[:NUMBER].EXTENSION convention. Return -1 if the name does
+// not follow that convention.
+//
+static int housedvr_index_source (const char *name) {
+
+    const char *start = strchr (name, '-');
+    if (!start) return -1;
+    start += 1;
+    const char *end = strrchr (start, '.');
+    const char *number = strrchr (start, ':');
+    if (number && ((!end) || (number < end))) end = number;
+    int length = end ? end - start : strlen(start);
+    if (length <= 0) return -1;
+
+    char source[128];
+    if (length >= sizeof(source)) length = sizeof(source) - 1;
+    memcpy (source, start, length);
+    source[length] = 0;
+
+    int i = housedvr_index_source_find (source);
+    if (i >= 0) return i;
+
+    if (IndexSourcesCount >= IndexSourcesSize) {
+        IndexSourcesSize += 16;
+        IndexSources =
+            realloc (IndexSources, IndexSourcesSize * sizeof(IndexSource));
+    }
+    IndexSource *new = IndexSources + IndexSourcesCount;
+    new->name = strdup (source);
+    new->signature = echttp_hash_signature (source);
+    new->count = 0;
+    new->start = 0;
+    new->size = 0;
+    new->recordings = 0;
+    new->bytes = 0;
+    return IndexSourcesCount++;
+}
+
+static void housedvr_index_source_attach (int recording) {
+
+    IndexSource *source = IndexSources + IndexRecordings[recording].source;
+
+    if (source->start + source->count >= source->size) {
+        if (source->start > source->size / 2) {
+            memmove (source->recordings, source->recordings + source->start,
+                     source->count * sizeof(int));
+            source->start = 0;
+        } else {
+            source->size += 256;
+            source->recordings =
+                realloc (source->recordings, source->size * sizeof(int));
+        }
+    }
+    int *list = source->recordings + source->start;
+    const char *path = IndexRecordings[recording].path;
+    int i;
+    for (i = source->count; i > 0; --i) {
+        if (strcmp (IndexRecordings[list[i-1]].path, path) < 0) break;
+        list[i] = list[i-1];
+    }
+    list[i] = recording;
+}
+
+static void housedvr_index_source_detach (int recording) {
+
+    IndexSource *source = IndexSources + IndexRecordings[recording].source;
+    int *list = source->recordings + source->start;
+    const char *path = IndexRecordings[recording].path;
+
+    if ((source->count > 0) && (list[0] == recording)) {
+        source->start += 1; // The most common case: the oldest recording.
+        return;
+    }
+    int low = 0;
+    int high = source->count - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        int order = strcmp (IndexRecordings[list[middle]].path, path);
+        if (order == 0) {
+            memmove (list + middle, list + middle + 1,
+                     (source->count - middle - 1) * sizeof(int));
+            return;
+        }
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+}
+
+// Account for a change in the size of a recording (delta), or for adding
+// (count 1) or removing (count -1) a recording.
+//
+static void housedvr_index_account (IndexRecording *recording,
+                                    IndexDay *day, int count, long long delta) {
+
+    IndexTotal += delta;
+    if (day) day->bytes += delta;
+    if (recording->source >= 0) {
+        IndexSource *source = IndexSources + recording->source;
+        if (count > 0) housedvr_index_source_attach (recording - IndexRecordings);
+        if (count < 0) housedvr_index_source_detach (recording - IndexRecordings);
+        source->count += count;
+        source->bytes += delta;
+    }
+    if (IndexStarted && (delta > 0)) IndexIngested += delta;
+}
+
+static IndexDay *housedvr_index_findday (int date, int create) {
+
+    int low = 0;
+    int high = IndexDaysCount - 1;
+
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (IndexDays[middle].date == date) return IndexDays + middle;
+        if (IndexDays[middle].date < date)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    if (!create) return 0;
+
+    if (IndexDaysCount >= IndexDaysSize) {
+        IndexDaysSize += 64;
+        IndexDays = realloc (IndexDays, IndexDaysSize * sizeof(IndexDay));
+    }
+    memmove (IndexDays + low + 1, IndexDays + low,
+             (IndexDaysCount - low) * sizeof(IndexDay));
+    IndexDaysCount += 1;
+
+    IndexDay *new = IndexDays + low;
+    new->date = date;
+    new->generation = 0;
+    new->count = 0;
+    new->size = 0;
+    new->unarchived = 0;
+    new->bytes = 0;
+    new->recordings = 0;
+    new->saved = -1;
+    memset (new->snapshot, 0, sizeof(new->snapshot));
+    return new;
+}
+
+// Insert the recording in its day, keeping the list sorted by name.
+// The recordings tend to be added in chronological order, so the search
+// for the insertion point starts from the end.
+//
+static void housedvr_index_attach (int recording) {
+
+    const char *name;
+    int date = housedvr_index_date (IndexRecordings[recording].path, &name);
+    if (!date) return;
+
+    IndexDay *day = housedvr_index_findday (date, 1);
+    housedvr_index_mark (date / 10000, (date / 100) % 100, date % 100);
+    if (day->count >= day->size) {
+        day->size += 64;
+        day->recordings = realloc (day->recordings, day->size * sizeof(int));
+    }
+    int i;
+    for (i = day->count; i > 0; --i) {
+        const char *other = IndexRecordings[day->recordings[i-1]].path;
+        if (strcmp (other, IndexRecordings[recording].path) < 0) break;
+        day->recordings[i] = day->recordings[i-1];
+    }
+    day->recordings[i] = recording;
+    day->count += 1;
+    if (!IndexRecordings[recording].tier) day->unarchived += 1;
+    day->generation = ++IndexGeneration;
+
+    IndexRecordings[recording].source = housedvr_index_source (name);
+    housedvr_index_account
+        (IndexRecordings + recording, day, 1, IndexRecordings[recording].size);
+}
+
+int housedvr_index_generation (int year, int month, int day) {
+
+    IndexDay *entry =
+        housedvr_index_findday ((year * 10000) + (month * 100) + day, 0);
+    return entry ? entry->generation : 0;
+}
+
+static void housedvr_index_rehash (void) {
+
+    int i;
+    IndexBucketsSize = (IndexBucketsSize > 0) ? IndexBucketsSize * 2 : 1024;
+    IndexBuckets = realloc (IndexBuckets, IndexBucketsSize * sizeof(int));
+    for (i = 0; i < IndexBucketsSize; ++i) IndexBuckets[i] = -1;
+
+    for (i = 0; i < IndexRecordingsCount; ++i) {
+        IndexRecording *cursor = IndexRecordings + i;
+        if (!cursor->path) continue;
+        int bucket = cursor->signature & (IndexBucketsSize - 1);
+        cursor->next = IndexBuckets[bucket];
+        IndexBuckets[bucket] = i;
+    }
+}
+
+static int housedvr_index_find (const char *path, unsigned int signature) {
+
+    if (!IndexBucketsSize) return -1;
+
+    int i = IndexBuckets[signature & (IndexBucketsSize - 1)];
+    while (i >= 0) {
+        IndexRecording *cursor = IndexRecordings + i;
+        if (cursor->signature == signature) { // Faster than strcmp().
+            if (!strcmp (cursor->path, path)) return i;
+        }
+        i = cursor->next;
+    }
+    return -1;
+}
+
+long long housedvr_index_size (const char *path) {
+
+    int i = housedvr_index_find (path, echttp_hash_signature (path));
+    if (i < 0) return -1;
+    return IndexRecordings[i].size;
+}
+
+static int housedvr_index_insert (const char *path, long long size, int tier) {
+
+    unsigned int signature = echttp_hash_signature (path);
+    int i = housedvr_index_find (path, signature);
+    if (i >= 0) {
+        IndexRecording *updated = IndexRecordings + i;
+        IndexDay *day = housedvr_index_findday (housedvr_index_date (path, 0), 0);
+        housedvr_index_account (updated, day, 0, size - updated->size);
+        if (updated->size != size) updated->digest = 0; // Not the same content.
+        updated->size = size;
+        if (day) {
+            if (updated->tier && !tier) day->unarchived += 1;
+            if (tier && !updated->tier) day->unarchived -= 1;
+            day->generation = ++IndexGeneration;
+        }
+        updated->tier = tier;
+        return i;
+    }
+
+    if (IndexRecordingsFree >= 0) {
+        i = IndexRecordingsFree;
+        IndexRecordingsFree = IndexRecordings[i].next;
+    } else {
+        if (IndexRecordingsCount >= IndexRecordingsSize) {
+            IndexRecordingsSize += 1024;
+            IndexRecordings = realloc (IndexRecordings,
+                                   IndexRecordingsSize * sizeof(IndexRecording));
+        }
+        i = IndexRecordingsCount++;
+    }
+    IndexRecording *new = IndexRecordings + i;
+    new->path = strdup (path);
+    new->signature = signature;
+    new->size = size;
+    new->digest = 0;
+    new->source = -1;
+    new->tier = tier;
+
+    if (IndexRecordingsCount >= IndexBucketsSize) {
+        housedvr_index_rehash (); // Also links the new recording.
+    } else {
+        int bucket = signature & (IndexBucketsSize - 1);
+        new->next = IndexBuckets[bucket];
+        IndexBuckets[bucket] = i;
+    }
+    housedvr_index_attach (i);
+    return i;
+}
+
+void housedvr_index_add (const char *path, long long size) {
+    housedvr_index_insert (path, size, 0); // New data is never archived.
+}
+
+void housedvr_index_digest_set (const char *path, unsigned int digest) {
+
+    int i = housedvr_index_find (path, echttp_hash_signature (path));
+    if (i < 0) return;
+    IndexRecordings[i].digest = digest;
+    IndexDay *day = housedvr_index_findday (housedvr_index_date (path, 0), 0);
+    if (day) day->generation = ++IndexGeneration; // Save it with the next snapshot.
+}
+
+unsigned int housedvr_index_digest (const char *path) {
+
+    int i = housedvr_index_find (path, echttp_hash_signature (path));
+    if (i < 0) return 0;
+    return IndexRecordings[i].digest;
+}
+
+int housedvr_index_tier (const char *path) {
+
+    int i = housedvr_index_find (path, echttp_hash_signature (path));
+    if (i < 0) return -1;
+    return IndexRecordings[i].tier;
+}
+
+void housedvr_index_archived (const char *path) {
+
+    int i = housedvr_index_find (path, echttp_hash_signature (path));
+    if (i < 0) return;
+    IndexRecording *recording = IndexRecordings + i;
+    if (recording->tier) return;
+    recording->tier = 1;
+
+    IndexDay *day = housedvr_index_findday (housedvr_index_date (path, 0), 0);
+    if (day) {
+        day->unarchived -= 1;
+        day->generation = ++IndexGeneration;
+    }
+}
+
+int housedvr_index_unarchived (int after, int before) {
+
+    int i;
+    for (i = 0; i < IndexDaysCount; ++i) {
+        if (IndexDays[i].date <= after) continue;
+        if (IndexDays[i].date >= before) break;
+        if (IndexDays[i].unarchived > 0) return IndexDays[i].date;
+    }
+    return 0;
+}
+
+const char *housedvr_index_first_tier (int date, int tier, long long *size) {
+
+    IndexDay *day = housedvr_index_findday (date, 0);
+    if (!day) return 0;
+
+    int i;
+    for (i = 0; i < day->count; ++i) {
+        IndexRecording *recording = IndexRecordings + day->recordings[i];
+        if (recording->tier != tier) continue;
+        if (size) *size = recording->size;
+        return recording->path;
+    }
+    return 0;
+}
+
+static void housedvr_index_release (int recording, IndexDay *day) {
+
+    IndexRecording *removed = IndexRecordings + recording;
+    housedvr_index_account (removed, day, -1, 0 - removed->size);
+
+    int *link = IndexBuckets + (removed->signature & (IndexBucketsSize - 1));
+    while (*link >= 0) {
+        if (*link == recording) {
+            *link = removed->next;
+            break;
+        }
+        link = &(IndexRecordings[*link].next);
+    }
+    free (removed->path);
+    removed->path = 0;
+    removed->next = IndexRecordingsFree;
+    IndexRecordingsFree = recording;
+}
+
+void housedvr_index_delete (const char *path) {
+
+    int recording = housedvr_index_find (path, echttp_hash_signature (path));
+    if (recording < 0) return;
+
+    IndexDay *day = housedvr_index_findday (housedvr_index_date (path, 0), 0);
+    if (day) {
+        int i;
+        for (i = 0; i < day->count; ++i) {
+            if (day->recordings[i] == recording) break;
+        }
+        if (i < day->count) {
+            if (!IndexRecordings[recording].tier) day->unarchived -= 1;
+            day->count -= 1;
+            memmove (day->recordings + i, day->recordings + i + 1,
+                     (day->count - i) * sizeof(int));
+        }
+        day->generation = ++IndexGeneration;
+    }
+    housedvr_index_release (recording, day);
+}
+
+int housedvr_index_oldest (void) {
+    return (IndexDaysCount > 0) ? IndexDays[0].date : 0;
+}
+
+const char *housedvr_index_first (int date, long long *size) {
+
+    IndexDay *day = housedvr_index_findday (date, 0);
+    if ((!day) || (day->count <= 0)) return 0;
+
+    IndexRecording *oldest = IndexRecordings + day->recordings[0];
+    if (size) *size = oldest->size;
+    return oldest->path;
+}
+
+long long housedvr_index_total (int date) {
+
+    if (!date) return IndexTotal;
+    IndexDay *day = housedvr_index_findday (date, 0);
+    return day ? day->bytes : 0;
+}
+
+long long housedvr_index_ingested (void) {
+    return IndexIngested;
+}
+
+const char *housedvr_index_source_first (int source, long long *size) {
+
+    if ((source < 0) || (source >= IndexSourcesCount)) return 0;
+    IndexSource *entry = IndexSources + source;
+    if (entry->count <= 0) return 0;
+
+    IndexRecording *oldest = IndexRecordings + entry->recordings[entry->start];
+    if (size) *size = oldest->size;
+    return oldest->path;
+}
+
+// The cursor is 0 on the first call. Then it is the position of the next
+// recording in the source's list (plus one), or the position of the next
+// day (plus one) in the high 32 bits and of the next recording in that day
+// in the low 32 bits.
+//
+const char *housedvr_index_enumerate (int source, int from,
+                                      long long *cursor, long long *size) {
+
+    int index;
+
+    if (source >= 0) {
+        if (source >= IndexSourcesCount) return 0;
+        IndexSource *entry = IndexSources + source;
+        int *list = entry->recordings + entry->start;
+        if (*cursor == 0) {
+            char prefix[32];
+            snprintf (prefix, sizeof(prefix), "%04d/%02d/%02d/",
+                      from / 10000, (from / 100) % 100, from % 100);
+            int low = 0;
+            int high = entry->count;
+            while (low < high) {
+                int middle = (low + high) / 2;
+                if (strcmp (IndexRecordings[list[middle]].path, prefix) < 0)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            *cursor = low + 1;
+        }
+        index = (int)(*cursor - 1);
+        if (index >= entry->count) return 0;
+        *cursor += 1;
+        IndexRecording *recording = IndexRecordings + list[index];
+        if (size) *size = recording->size;
+        return recording->path;
+    }
+
+    if (*cursor == 0) {
+        int low = 0;
+        int high = IndexDaysCount;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (IndexDays[middle].date < from)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        *cursor = ((long long)(low + 1)) << 32;
+    }
+    int day = (int)(*cursor >> 32) - 1;
+    index = (int)(*cursor & 0xffffffff);
+    while ((day < IndexDaysCount) && (index >= IndexDays[day].count)) {
+        day += 1;
+        index = 0;
+    }
+    if (day >= IndexDaysCount) return 0;
+    *cursor = (((long long)(day + 1)) << 32) + index + 1;
+    IndexRecording *recording = IndexRecordings + IndexDays[day].recordings[index];
+    if (size) *size = recording->size;
+    return recording->path;
+}
+
+long long housedvr_index_source_total (int source) {
+    if ((source < 0) || (source >= IndexSourcesCount)) return 0;
+    return IndexSources[source].bytes;
+}
+
+void housedvr_index_status (HouseDvrBuffer *output) {
+
+    int i;
+    int count = 0;
+    for (i = 0; i < IndexDaysCount; ++i) count += IndexDays[i].count;
+
+    housedvr_buffer_printf (output,
+                            "\"usage\":{\"recordings\":%d,\"bytes\":%lld,"
+                                "\"days\":%d,\"sources\":[",
+                            count, IndexTotal, IndexDaysCount);
+    const char *sep = "";
+    for (i = 0; i < IndexSourcesCount; ++i) {
+        IndexSource *source = IndexSources + i;
+        if (source->count <= 0) continue;
+        housedvr_buffer_printf (output,
+                                "%s{\"name\":\"%s\",\"count\":%d,\"bytes\":%lld}",
+                                sep, source->name, source->count, source->bytes);
+        sep = ",";
+    }
+    housedvr_buffer_printf (output, "]}");
+}
+
+void housedvr_index_forget (int year, int month, int day) {
+
+    IndexYear *entry = housedvr_index_year (year, 0);
+    if (entry) {
+        if (month <= 0) {
+            IndexYearsCount -= 1;
+            memmove (entry, entry + 1,
+                     (IndexYearsCount - (entry - IndexYears)) * sizeof(IndexYear));
+        } else if (month <= 12) {
+            if (day <= 0) {
+                entry->months &= ~(1u << month);
+                entry->days[month] = 0;
+            } else if (day <= 31) {
+                entry->days[month] &= ~(1u << day);
+            }
+        }
+    }
+    if ((month <= 0) || (day <= 0)) return; // No recording at that level.
+
+    int date = (year * 10000) + (month * 100) + day;
+    IndexDay *removed = housedvr_index_findday (date, 0);
+    if (!removed) return;
+
+    int i;
+    for (i = 0; i < removed->count; ++i) {
+        housedvr_index_release (removed->recordings[i], removed);
+    }
+    free (removed->recordings);
+    housedvr_buffer_free (removed->snapshot);
+    housedvr_buffer_free (removed->snapshot + 1);
+    IndexGeneration += 1;
+    IndexDaysCount -= 1;
+    memmove (removed, removed + 1,
+             (IndexDaysCount - (removed - IndexDays)) * sizeof(IndexDay));
+}
+
+// The snapshot of the index, as loaded at startup. Each day records the
+// modification time of the day directory when the snapshot was saved: if
+// the directory did not change since, its content is taken from the
+// snapshot instead of reading the directory and each file's status.
+//
+typedef struct {
+    int tier;
+    int date;
+    long long seconds;
+    long nanoseconds;
+    int count;
+    char *files; // "size[:digest] name" lines, within the snapshot text.
+} IndexSnapshotDay;
+
+static const char *IndexSnapshotPath = 0;
+static int IndexSnapshotGeneration = -1;
+
+// The snapshot being written by the helper thread. The main thread does
+// not touch the buffer until the thread is done (IndexSaving back to 0).
+static HouseDvrBuffer IndexSaveBuffer;
+static volatile int IndexSaving = 0;
+static const char * volatile IndexSaveError = 0;
+
+static IndexSnapshotDay *IndexSnapshot = 0;
+static int IndexSnapshotCount = 0;
+static char *IndexSnapshotText = 0;
+
+static int IndexWalkTier = 0; // The tier being walked at startup.
+
+#define INDEX_SNAPSHOT_MAGIC "housedvr-index 3"
+#define INDEX_SNAPSHOT_PERIOD 300
+
+static void housedvr_index_load (void) {
+
+    if (!IndexSnapshotPath) return;
+
+    int fd = open (IndexSnapshotPath, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat info;
+    if (fstat (fd, &info) || (info.st_size <= 0)) {
+        close (fd);
+        return;
+    }
+    IndexSnapshotText = malloc (info.st_size + 1);
+    if (!IndexSnapshotText) {
+        close (fd);
+        return;
+    }
+    long long loaded = 0;
+    while (loaded < info.st_size) {
+        int got = read (fd, IndexSnapshotText + loaded, info.st_size - loaded);
+        if (got <= 0) break;
+        loaded += got;
+    }
+    close (fd);
+    IndexSnapshotText[loaded] = 0;
+
+    char *line = IndexSnapshotText;
+    if (strncmp (line, INDEX_SNAPSHOT_MAGIC "\n", sizeof(INDEX_SNAPSHOT_MAGIC))) {
+        houselog_trace (HOUSE_FAILURE, IndexSnapshotPath, "invalid snapshot");
+        return;
+    }
+    line += sizeof(INDEX_SNAPSHOT_MAGIC);
+
+    int size = 0;
+    while (*line == 'D') {
+        IndexSnapshotDay day;
+        if (sscanf (line, "D %d %d %lld %ld %d",
+                    &day.tier, &day.date, &day.seconds,
+                    &day.nanoseconds, &day.count) != 5) break;
+        line = strchr (line, '\n');
+        if (!line) break;
+        day.files = ++line;
+
+        int i;
+        for (i = 0; i < day.count; ++i) {
+            line = strchr (line, '\n');
+            if (!line) break;
+            line += 1;
+        }
+        if (i < day.count) break; // Truncated file.
+
+        if (IndexSnapshotCount >= size) {
+            size += 256;
+            IndexSnapshot = realloc (IndexSnapshot,
+                                     size * sizeof(IndexSnapshotDay));
+        }
+        IndexSnapshot[IndexSnapshotCount++] = day;
+    }
+    DEBUG ("Loaded snapshot of %d days from %s\n",
+           IndexSnapshotCount, IndexSnapshotPath);
+}
+
+// The snapshot is sorted by tier, then by date.
+//
+static IndexSnapshotDay *housedvr_index_snapshot (int tier, int date) {
+
+    int low = 0;
+    int high = IndexSnapshotCount - 1;
+
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        IndexSnapshotDay *cursor = IndexSnapshot + middle;
+        if ((cursor->tier == tier) && (cursor->date == date)) return cursor;
+        if ((cursor->tier < tier) ||
+            ((cursor->tier == tier) && (cursor->date < date)))
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return 0;
+}
+
+// Restore the content of one day from the snapshot, if the day directory
+// did not change. Return 1 on success, 0 if the directory must be read.
+//
+static int housedvr_index_restore (const char *path, const struct stat *info) {
+
+    int date = housedvr_index_date (path, 0);
+    IndexSnapshotDay *day = housedvr_index_snapshot (IndexWalkTier, date);
+    if (!day) return 0;
+    if (day->seconds != (long long)(info->st_mtim.tv_sec)) return 0;
+    if (day->nanoseconds != info->st_mtim.tv_nsec) return 0;
+
+    char filepath[512];
+    int length = snprintf (filepath, sizeof(filepath), "%s", path);
+    if (length >= sizeof(filepath) - 1) return 0;
+
+    const char *line = day->files;
+    int i;
+    for (i = 0; i < day->count; ++i) {
+        char *name;
+        unsigned int digest = 0;
+        long long size = strtoll (line, &name, 10);
+        if (*name == ':') digest = strtoul (name + 1, &name, 16);
+        const char *eol = strchr (name, '\n');
+        if (*name == ' ') name += 1;
+        snprintf (filepath+length, sizeof(filepath)-length,
+                  "%.*s", (int)(eol - name), name);
+        int recording = housedvr_index_insert (filepath, size, IndexWalkTier);
+        if (recording >= 0) IndexRecordings[recording].digest = digest;
+        line = eol + 1;
+    }
+    return 1;
+}
+
+// Build the snapshot text of one day, on each tier. The modification time
+// of the day directory must be read after the day's latest change.
+//
+static void housedvr_index_save_day (IndexDay *day) {
+
+    char path[1024];
+    struct stat info;
+    int j, tier;
+
+    for (tier = 0; tier < 2; ++tier) {
+        HouseDvrBuffer *text = day->snapshot + tier;
+        housedvr_buffer_reset (text);
+
+        const char *root =
+            tier ? housedvr_store_archive() : housedvr_store_root();
+        if (!root) continue;
+
+        snprintf (path, sizeof(path), "%s/%d/%02d/%02d", root,
+                  day->date / 10000, (day->date / 100) % 100,
+                  day->date % 100);
+        if (stat (path, &info)) continue;
+
+        int count = tier ? day->count - day->unarchived : day->unarchived;
+        housedvr_buffer_printf (text, "D %d %d %lld %ld %d\n",
+                                tier, day->date,
+                                (long long)(info.st_mtim.tv_sec),
+                                (long)(info.st_mtim.tv_nsec), count);
+        for (j = 0; j < day->count; ++j) {
+            const char *name;
+            IndexRecording *recording = IndexRecordings + day->recordings[j];
+            if (recording->tier != tier) continue;
+            housedvr_index_date (recording->path, &name);
+            if (recording->digest)
+                housedvr_buffer_printf (text, "%lld:%08x %s\n",
+                                        recording->size, recording->digest,
+                                        name);
+            else
+                housedvr_buffer_printf (text, "%lld %s\n",
+                                        recording->size, name);
+        }
+    }
+    day->saved = day->generation;
+}
+
+static void *housedvr_index_writer (void *context) {
+
+    char temp[1024];
+    const char *error = 0;
+
+    snprintf (temp, sizeof(temp), "%s.tmp", IndexSnapshotPath);
+    int out = open (temp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (out < 0) {
+        error = "cannot create";
+    } else {
+        const char *data = IndexSaveBuffer.data;
+        int length = IndexSaveBuffer.length;
+        while (length > 0) {
+            ssize_t written = write (out, data, length);
+            if (written <= 0) break;
+            data += written;
+            length -= written;
+        }
+        if (close (out) || (length > 0)) {
+            error = "write error";
+        } else if (rename (temp, IndexSnapshotPath)) {
+            error = "cannot rename";
+        }
+        if (error) unlink (temp);
+    }
+    IndexSaveError = error;
+    __sync_synchronize();
+    IndexSaving = 0;
+    return 0;
+}
+
+// Assemble the snapshot from the text of each day, and hand it over to
+// a helper thread for writing.
+//
+static void housedvr_index_save (void) {
+
+    int i, tier;
+    pthread_t writer;
+
+    if (IndexSaving) return; // Try again later.
+
+    housedvr_buffer_reset (&IndexSaveBuffer);
+    housedvr_buffer_printf (&IndexSaveBuffer, "%s\n", INDEX_SNAPSHOT_MAGIC);
+
+    for (i = 0; i < IndexDaysCount; ++i) {
+        IndexDay *day = IndexDays + i;
+        if (day->saved != day->generation) housedvr_index_save_day (day);
+    }
+    for (tier = 0; tier < 2; ++tier) {
+        for (i = 0; i < IndexDaysCount; ++i) {
+            HouseDvrBuffer *text = IndexDays[i].snapshot + tier;
+            if (text->length > 0)
+                housedvr_buffer_append (&IndexSaveBuffer,
+                                        text->data, text->length);
+        }
+    }
+
+    IndexSaving = 1;
+    if (pthread_create (&writer, 0, housedvr_index_writer, 0)) {
+        IndexSaving = 0;
+        houselog_trace (HOUSE_FAILURE, IndexSnapshotPath,
+                        "cannot start the writer");
+        return;
+    }
+    pthread_detach (writer);
+    IndexSnapshotGeneration = IndexGeneration;
+}
+
+// Walk the storage tree, following the YYYY/MM/DD/name structure. Any
+// other file or directory is ignored.
+//
+// The directories are read using getdents64() directly, with a large
+// buffer, and each file is accessed relative to its directory (openat(),
+// fstatat()), so that the kernel does not have to resolve the full path
+// again and again.
+//
+struct IndexDirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+static void housedvr_index_walk (int dirfd, char *path, int length, int depth) {
+
+    static char buffers[4][32768]; // One per level, since this recurses.
+    char *buffer = buffers[depth];
+    struct stat info;
+    int restored = 0;
+
+    for (;;) {
+        int got = syscall (SYS_getdents64, dirfd, buffer, sizeof(buffers[0]));
+        if (got <= 0) break;
+
+        int offset;
+        for (offset = 0; offset < got; ) {
+            struct IndexDirent64 *p = (struct IndexDirent64 *)(buffer + offset);
+            offset += p->d_reclen;
+
+            if (p->d_name[0] == '.') continue;
+
+            int added = snprintf (path + length, 512 - length, "%s", p->d_name);
+            if (length + added >= 511) continue; // Too long, ignore.
+
+            int type = p->d_type;
+            if (type == DT_UNKNOWN) {
+                if (fstatat (dirfd, p->d_name, &info, 0)) continue;
+                type = S_ISDIR(info.st_mode) ? DT_DIR : DT_REG;
+            }
+
+            if (depth < 3) {
+                if (type != DT_DIR) continue;
+                if (!isdigit(p->d_name[0])) continue;
+                housedvr_index_calendar_add (path);
+
+                if (depth == 2) {
+                    // A day directory: try the snapshot first.
+                    if (fstatat (dirfd, p->d_name, &info, 0)) continue;
+                    path[length + added] = '/';
+                    path[length + added + 1] = 0;
+                    if (housedvr_index_restore (path, &info)) {
+                        restored += 1;
+                        continue;
+                    }
+                }
+                int subfd = openat (dirfd, p->d_name, O_RDONLY|O_DIRECTORY);
+                if (subfd < 0) continue;
+                path[length + added] = '/';
+                path[length + added + 1] = 0;
+                housedvr_index_walk (subfd, path, length + added + 1, depth + 1);
+                close (subfd);
+            } else {
+                if (type == DT_DIR) continue;
+                if (fstatat (dirfd, p->d_name, &info, 0)) continue;
+                housedvr_index_insert (path, (long long)(info.st_size),
+                                       IndexWalkTier);
+            }
+        }
+    }
+    path[length] = 0;
+    if (restored) DEBUG ("Restored %d days from the snapshot\n", restored);
+}
+
+void housedvr_index_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-dvr-index=", argv[i], &IndexSnapshotPath);
+    }
+    time_t start = time(0);
+
+    housedvr_index_load ();
+
+    // Walk the archive first: if a recording is found on both tiers
+    // (interrupted migration), the copy on the main storage prevails.
+    //
+    for (IndexWalkTier = 1; IndexWalkTier >= 0; --IndexWalkTier) {
+        const char *root =
+            IndexWalkTier ? housedvr_store_archive() : housedvr_store_root();
+        if (!root) continue;
+        int rootfd = open (root, O_RDONLY|O_DIRECTORY);
+        if (rootfd >= 0) {
+            char path[512];
+            path[0] = 0;
+            housedvr_index_walk (rootfd, path, 0, 0);
+            close (rootfd);
+        }
+    }
+    IndexWalkTier = 0;
+
+    // The snapshot is not needed anymore.
+    free (IndexSnapshot);
+    free (IndexSnapshotText);
+    IndexSnapshot = 0;
+    IndexSnapshotText = 0;
+    IndexSnapshotCount = 0;
+
+    IndexStarted = 1; // From now on, count the new data.
+
+    DEBUG ("Indexed %d recordings over %d days in %d seconds\n",
+           IndexRecordingsCount, IndexDaysCount, (int)(time(0) - start));
+
+    if (IndexSnapshotPath) housedvr_index_save ();
+}
+
+void housedvr_index_background (time_t now) {
+
+    static time_t NextSave = 0;
+
+    if (!IndexSnapshotPath) return;
+    if (IndexSaving) return;
+
+    if (IndexSaveError) {
+        houselog_trace (HOUSE_FAILURE, IndexSnapshotPath,
+                        "%s", IndexSaveError);
+        IndexSaveError = 0;
+        IndexSnapshotGeneration = -1; // Save again at the next period.
+    }
+    if (now < NextSave) return;
+    NextSave = now + INDEX_SNAPSHOT_PERIOD;
+
+    if (IndexSnapshotGeneration != IndexGeneration) housedvr_index_save ();
+}
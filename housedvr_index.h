@@ -0,0 +1,49 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedvr_index.h - An in-memory index of the stored recordings.
+ */
+void         housedvr_index_initialize (int argc, const char **argv);
+void         housedvr_index_background (time_t now);
+long long    housedvr_index_size (const char *path);
+void         housedvr_index_add (const char *path, long long size);
+void         housedvr_index_digest_set (const char *path, unsigned int digest);
+unsigned int housedvr_index_digest (const char *path);
+void         housedvr_index_forget (int year, int month, int day);
+void         housedvr_index_delete (const char *path);
+int          housedvr_index_oldest (void);
+const char  *housedvr_index_first (int date, long long *size);
+int          housedvr_index_tier (const char *path);
+void         housedvr_index_archived (const char *path);
+int          housedvr_index_unarchived (int after, int before);
+const char  *housedvr_index_first_tier (int date, int tier, long long *size);
+long long    housedvr_index_total (int date);
+long long    housedvr_index_ingested (void);
+int          housedvr_index_source_find (const char *name);
+const char  *housedvr_index_source_first (int source, long long *size);
+long long    housedvr_index_source_total (int source);
+const char  *housedvr_index_enumerate (int source, int from,
+                                      long long *cursor, long long *size);
+void         housedvr_index_status (HouseDvrBuffer *output);
+int          housedvr_index_generation (int year, int month, int day);
+void         housedvr_index_calendar_add (const char *path);
+int          housedvr_index_years (int *years, int size);
+unsigned int housedvr_index_months (int year);
+unsigned int housedvr_index_days (int year, int month);
@@ -0,0 +1,642 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedvr_metrics.c - Collect performance metrics about the transfers.
+ *
+ * SYNOPSYS:
+ *
+ * This module accumulates counters about the transfers of recordings,
+ * both globally and for each CCTV service, and reports them through the
+ * /dvr/metrics URI, either in JSON (default) or in the Prometheus text
+ * format (format=prometheus parameter). The counters are never reset,
+ * except when HouseDvr restarts.
+ *
+ * This module also measures how long each phase of the background
+ * processing, and each HTTP request handler, runs. Since everything
+ * runs in the same event loop, any long phase delays all the other
+ * processing. The most recent durations of each phase are kept, to
+ * report a rolling maximum and 99th percentile. The -dvr-slow=MS option
+ * causes any phase that ran longer than the specified threshold to be
+ * logged.
+ *
+ * void housedvr_metrics_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * long long housedvr_metrics_clock (void);
+ * long long housedvr_metrics_microseconds (void);
+ *
+ *    Return a monotonic time in milliseconds or microseconds, used to
+ *    measure durations.
+ *
+ * void housedvr_metrics_transfer (const char *server, int status,
+ *                                 long long bytes,
+ *                                 long long duration, long long waited);
+ *
+ *    Record the end of one transfer: the HTTP status, the number of bytes
+ *    received, how long the transfer took and how long it waited in
+ *    the queue before starting (both in milliseconds).
+ *
+ * void housedvr_metrics_rejected (const char *server);
+ *
+ *    Record that a notification was ignored because the queue was full.
+ *
+ * void housedvr_metrics_queue (time_t now, int depth, int active);
+ *
+ *    Record the current depth of the transfer queue (pending transfers)
+ *    and the number of active transfers. This is called every second.
+ *    The queue depth history holds the highest depth for each period.
+ *
+ * int housedvr_metrics_phase (const char *name);
+ *
+ *    Declare a phase to be timed, and return its identifier.
+ *
+ * long long housedvr_metrics_elapsed (int phase, long long start);
+ *
+ *    Record the duration of one run of the specified phase, from the
+ *    start time (microseconds) to now. Return the current time, so that
+ *    consecutive phases can be timed in sequence.
+ *
+ * int housedvr_metrics_route (const char *uri, echttp_callback *call);
+ *
+ *    Register an HTTP route (same as echttp_route_uri), with its handler
+ *    timed as a phase named after the URI.
+ *
+ * int housedvr_metrics_match (const char *root, echttp_callback *call);
+ *
+ *    Same as housedvr_metrics_route(), for all the URIs that start with
+ *    the specified root (same as echttp_route_match).
+ *
+ * void housedvr_metrics_status (HouseDvrBuffer *output);
+ *
+ *    Append the phase latency statistics to a JSON status.
+ */
+
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <echttp.h>
+#include <echttp_hash.h> // Just for the signature.
+
+#include "houselog.h"
+
+#include "housedvr_buffer.h"
+#include "housedvr_metrics.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+// The duration histogram bounds, in seconds. The last bucket has no bound.
+//
+static const int MetricsBounds[] = {1, 2, 5, 10, 30, 60, 120};
+#define METRICS_BUCKETS (sizeof(MetricsBounds)/sizeof(MetricsBounds[0]) + 1)
+
+#define METRICS_CODES 8 // The number of distinct failure codes tracked.
+
+typedef struct {
+    long long transfers;
+    long long failures;
+    long long rejected;
+    long long bytes;
+    long long duration; // Milliseconds, successful transfers only.
+    long long waited;   // Milliseconds, all transfers.
+    long long waitmax;
+    long long histogram[METRICS_BUCKETS];
+    struct {
+        int code; // 0: any other code.
+        long long count;
+    } errors[METRICS_CODES];
+} MetricsCounters;
+
+// The per-server counters are kept in a table that grows as needed,
+// indexed by an hash table with chaining. The CCTV services come and go
+// rarely, so entries are never removed.
+//
+#define METRICS_HASH 128 // Must be a power of 2.
+
+typedef struct {
+    char server[128];
+    unsigned int signature;
+    int next;
+    MetricsCounters counters;
+} MetricsServer;
+
+static MetricsServer *MetricsServers = 0;
+static int            MetricsServersCount = 0;
+static int            MetricsServersSize = 0;
+
+static int MetricsByServer[METRICS_HASH];
+
+static MetricsCounters MetricsGlobal;
+
+// The queue depth history: one sample per period, kept for one hour.
+//
+#define METRICS_PERIOD  10
+#define METRICS_SAMPLES 360
+
+static struct {
+    int current;
+    int active;
+    int highest; // Highest depth seen during the current period.
+    time_t next;
+    int cursor;
+    int count;
+    int samples[METRICS_SAMPLES];
+} MetricsQueue;
+
+// The latency of each phase: the most recent durations (microseconds)
+// are kept in a circular list, to calculate the rolling statistics.
+//
+#define METRICS_PHASES  32
+#define METRICS_HISTORY 256
+
+typedef struct {
+    const char *name;
+    long long count;
+    int cursor;
+    int samples[METRICS_HISTORY];
+} MetricsPhase;
+
+static MetricsPhase MetricsPhases[METRICS_PHASES];
+static int          MetricsPhasesCount = 0;
+
+static int MetricsSlow = 0; // Microseconds, 0: do not log.
+
+typedef struct {
+    const char *uri;
+    int prefix; // Length to match, 0 for an exact match.
+    echttp_callback *call;
+    int phase;
+} MetricsRoute;
+
+static MetricsRoute MetricsRoutes[METRICS_PHASES];
+static int          MetricsRoutesCount = 0;
+
+static time_t MetricsStarted = 0;
+static char   MetricsHost[256];
+
+
+long long housedvr_metrics_microseconds (void) {
+
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+long long housedvr_metrics_clock (void) {
+    return housedvr_metrics_microseconds () / 1000;
+}
+
+int housedvr_metrics_phase (const char *name) {
+
+    if (MetricsPhasesCount >= METRICS_PHASES) return -1;
+    MetricsPhase *phase = MetricsPhases + MetricsPhasesCount;
+    phase->name = name;
+    phase->count = 0;
+    phase->cursor = 0;
+    return MetricsPhasesCount++;
+}
+
+long long housedvr_metrics_elapsed (int phase, long long start) {
+
+    long long now = housedvr_metrics_microseconds ();
+    if ((phase < 0) || (phase >= MetricsPhasesCount)) return now;
+
+    MetricsPhase *p = MetricsPhases + phase;
+    long long elapsed = now - start;
+    if (elapsed > INT_MAX) elapsed = INT_MAX;
+
+    p->samples[p->cursor] = (int)elapsed;
+    p->cursor = (p->cursor + 1) % METRICS_HISTORY;
+    p->count += 1;
+
+    if (MetricsSlow && (elapsed > MetricsSlow)) {
+        DEBUG ("Phase %s ran for %lld ms\n", p->name, elapsed / 1000);
+        houselog_trace (HOUSE_INFO, "LATENCY",
+                        "%s ran for %lld ms", p->name, elapsed / 1000);
+    }
+    return now;
+}
+
+static const char *housedvr_metrics_routed (const char *method,
+                                            const char *uri,
+                                            const char *data, int length) {
+    int i;
+    int size = strcspn (uri, "?");
+    for (i = 0; i < MetricsRoutesCount; ++i) {
+        const char *match = MetricsRoutes[i].uri;
+        int prefix = MetricsRoutes[i].prefix;
+        if (prefix) {
+            if ((size >= prefix) && (!strncmp (match, uri, prefix))) break;
+        } else if ((!strncmp (match, uri, size)) && (match[size] == 0)) {
+            break;
+        }
+    }
+    if (i >= MetricsRoutesCount) {
+        echttp_error (404, "Not found");
+        return "";
+    }
+    long long start = housedvr_metrics_microseconds ();
+    const char *result = MetricsRoutes[i].call (method, uri, data, length);
+    housedvr_metrics_elapsed (MetricsRoutes[i].phase, start);
+    return result;
+}
+
+int housedvr_metrics_route (const char *uri, echttp_callback *call) {
+
+    if (MetricsRoutesCount >= METRICS_PHASES)
+        return echttp_route_uri (uri, call); // Not timed.
+
+    MetricsRoute *route = MetricsRoutes + MetricsRoutesCount++;
+    route->uri = uri;
+    route->prefix = 0;
+    route->call = call;
+    route->phase = housedvr_metrics_phase (uri);
+    return echttp_route_uri (uri, housedvr_metrics_routed);
+}
+
+int housedvr_metrics_match (const char *root, echttp_callback *call) {
+
+    if (MetricsRoutesCount >= METRICS_PHASES)
+        return echttp_route_match (root, call); // Not timed.
+
+    MetricsRoute *route = MetricsRoutes + MetricsRoutesCount++;
+    route->uri = root;
+    route->prefix = strlen (root);
+    route->call = call;
+    route->phase = housedvr_metrics_phase (root);
+    return echttp_route_match (root, housedvr_metrics_routed);
+}
+
+static int housedvr_metrics_compare (const void *a, const void *b) {
+    return *((const int *)a) - *((const int *)b);
+}
+
+void housedvr_metrics_status (HouseDvrBuffer *output) {
+
+    int i;
+    const char *sep = "";
+    int sorted[METRICS_HISTORY];
+
+    housedvr_buffer_printf (output, "\"latency\":[");
+    for (i = 0; i < MetricsPhasesCount; ++i) {
+        MetricsPhase *p = MetricsPhases + i;
+        int count = (p->count < METRICS_HISTORY) ? (int)(p->count)
+                                                   : METRICS_HISTORY;
+        int max = 0;
+        int p99 = 0;
+        if (count > 0) {
+            memcpy (sorted, p->samples, count * sizeof(int));
+            qsort (sorted, count, sizeof(int), housedvr_metrics_compare);
+            max = sorted[count - 1];
+            p99 = sorted[(count * 99) / 100];
+        }
+        housedvr_buffer_printf (output,
+                                "%s{\"name\":\"%s\",\"count\":%lld"
+                                    ",\"max\":%d,\"p99\":%d}",
+                                sep, p->name, p->count, max, p99);
+        sep = ",";
+    }
+    housedvr_buffer_printf (output, "]");
+}
+
+static MetricsCounters *housedvr_metrics_server (const char *server) {
+
+    unsigned int signature = echttp_hash_signature (server);
+    int *bucket = MetricsByServer + (signature & (METRICS_HASH - 1));
+
+    int i;
+    for (i = *bucket; i >= 0; i = MetricsServers[i].next) {
+        if (MetricsServers[i].signature != signature) continue;
+        if (!strcmp (MetricsServers[i].server, server))
+            return &(MetricsServers[i].counters);
+    }
+
+    if (MetricsServersCount >= MetricsServersSize) {
+        MetricsServersSize += 16;
+        MetricsServers = realloc (MetricsServers,
+                                  MetricsServersSize * sizeof(MetricsServer));
+        if (!MetricsServers) return 0;
+    }
+    i = MetricsServersCount++;
+    memset (MetricsServers + i, 0, sizeof(MetricsServer));
+    snprintf (MetricsServers[i].server,
+              sizeof(MetricsServers[i].server), "%s", server);
+    MetricsServers[i].signature = signature;
+    MetricsServers[i].next = *bucket;
+    *bucket = i;
+    return &(MetricsServers[i].counters);
+}
+
+static void housedvr_metrics_count (MetricsCounters *counters, int status,
+                                    long long bytes,
+                                    long long duration, long long waited) {
+
+    counters->waited += waited;
+    if (waited > counters->waitmax) counters->waitmax = waited;
+
+    if (status / 100 != 2) {
+        counters->failures += 1;
+        int i;
+        for (i = 0; i < METRICS_CODES - 1; ++i) {
+            if (counters->errors[i].code == status) break;
+            if (counters->errors[i].code == 0) {
+                counters->errors[i].code = status;
+                break;
+            }
+        }
+        counters->errors[i].count += 1; // The last entry is for other codes.
+        return;
+    }
+
+    counters->transfers += 1;
+    counters->bytes += bytes;
+    counters->duration += duration;
+
+    int bucket;
+    for (bucket = 0; bucket < METRICS_BUCKETS - 1; ++bucket) {
+        if (duration <= MetricsBounds[bucket] * 1000) break;
+    }
+    counters->histogram[bucket] += 1;
+}
+
+void housedvr_metrics_transfer (const char *server, int status,
+                                long long bytes,
+                                long long duration, long long waited) {
+
+    housedvr_metrics_count (&MetricsGlobal, status, bytes, duration, waited);
+
+    MetricsCounters *counters = housedvr_metrics_server (server);
+    if (counters)
+        housedvr_metrics_count (counters, status, bytes, duration, waited);
+}
+
+void housedvr_metrics_rejected (const char *server) {
+
+    MetricsGlobal.rejected += 1;
+
+    MetricsCounters *counters = housedvr_metrics_server (server);
+    if (counters) counters->rejected += 1;
+}
+
+void housedvr_metrics_queue (time_t now, int depth, int active) {
+
+    MetricsQueue.current = depth;
+    MetricsQueue.active = active;
+    if (depth > MetricsQueue.highest) MetricsQueue.highest = depth;
+
+    if (now < MetricsQueue.next) return;
+    if (MetricsQueue.next > 0) {
+        MetricsQueue.samples[MetricsQueue.cursor] = MetricsQueue.highest;
+        MetricsQueue.cursor = (MetricsQueue.cursor + 1) % METRICS_SAMPLES;
+        if (MetricsQueue.count < METRICS_SAMPLES) MetricsQueue.count += 1;
+    }
+    MetricsQueue.highest = depth;
+    MetricsQueue.next = now + METRICS_PERIOD;
+}
+
+// Return the transfer rate in MB/s.
+//
+static double housedvr_metrics_rate (const MetricsCounters *counters) {
+    if (counters->duration <= 0) return 0.0;
+    return (counters->bytes / 1000.0) / counters->duration;
+}
+
+static void housedvr_metrics_json (HouseDvrBuffer *output,
+                                   const MetricsCounters *counters) {
+
+    int i;
+    const char *sep = "";
+
+    housedvr_buffer_printf (output,
+                            "\"transfers\":%lld,\"failures\":%lld"
+                                ",\"rejected\":%lld,\"bytes\":%lld"
+                                ",\"duration\":%lld,\"rate\":%.3f"
+                                ",\"waited\":%lld,\"waitmax\":%lld"
+                                ",\"histogram\":[",
+                            counters->transfers, counters->failures,
+                            counters->rejected, counters->bytes,
+                            counters->duration,
+                            housedvr_metrics_rate (counters),
+                            counters->waited, counters->waitmax);
+
+    for (i = 0; i < METRICS_BUCKETS; ++i) {
+        housedvr_buffer_printf (output, "%s%lld", sep, counters->histogram[i]);
+        sep = ",";
+    }
+    housedvr_buffer_printf (output, "],\"errors\":{");
+    sep = "";
+    for (i = 0; i < METRICS_CODES; ++i) {
+        if (!counters->errors[i].count) continue;
+        if (counters->errors[i].code)
+            housedvr_buffer_printf (output, "%s\"%d\":%lld", sep,
+                                    counters->errors[i].code,
+                                    counters->errors[i].count);
+        else
+            housedvr_buffer_printf (output, "%s\"other\":%lld", sep,
+                                    counters->errors[i].count);
+        sep = ",";
+    }
+    housedvr_buffer_printf (output, "}");
+}
+
+static const char *housedvr_metrics_format_json (HouseDvrBuffer *output) {
+
+    int i;
+    const char *sep = "";
+
+    housedvr_buffer_printf (output,
+                            "{\"host\":\"%s\",\"timestamp\":%lld"
+                                ",\"metrics\":{\"started\":%lld"
+                                ",\"bounds\":[",
+                            MetricsHost, (long long)time(0),
+                            (long long)MetricsStarted);
+    for (i = 0; i < METRICS_BUCKETS - 1; ++i) {
+        housedvr_buffer_printf (output, "%s%d", sep, MetricsBounds[i]);
+        sep = ",";
+    }
+    housedvr_buffer_printf (output, "],\"global\":{");
+    housedvr_metrics_json (output, &MetricsGlobal);
+    housedvr_buffer_printf (output, "},\"servers\":[");
+
+    sep = "";
+    for (i = 0; i < MetricsServersCount; ++i) {
+        housedvr_buffer_printf (output, "%s{\"server\":\"%s\",",
+                                sep, MetricsServers[i].server);
+        housedvr_metrics_json (output, &(MetricsServers[i].counters));
+        housedvr_buffer_printf (output, "}");
+        sep = ",";
+    }
+
+    housedvr_buffer_printf (output,
+                            "],\"queue\":{\"depth\":%d,\"active\":%d"
+                                ",\"period\":%d,\"samples\":[",
+                            MetricsQueue.current, MetricsQueue.active,
+                            METRICS_PERIOD);
+    sep = "";
+    int index = MetricsQueue.cursor - MetricsQueue.count;
+    if (index < 0) index += METRICS_SAMPLES;
+    for (i = 0; i < MetricsQueue.count; ++i) {
+        housedvr_buffer_printf (output, "%s%d",
+                                sep, MetricsQueue.samples[index]);
+        index = (index + 1) % METRICS_SAMPLES;
+        sep = ",";
+    }
+    housedvr_buffer_printf (output, "]},");
+    housedvr_metrics_status (output);
+    housedvr_buffer_printf (output, "}}");
+
+    echttp_content_type_json ();
+    return output->data;
+}
+
+static void housedvr_metrics_help (HouseDvrBuffer *output, const char *name,
+                                   const char *type, const char *help) {
+    housedvr_buffer_printf (output,
+                            "# HELP %s %s\n# TYPE %s %s\n",
+                            name, help, name, type);
+}
+
+static const char *housedvr_metrics_format_prometheus (HouseDvrBuffer *output) {
+
+    int i, j;
+
+    housedvr_metrics_help (output, "housedvr_transfers_total", "counter",
+                           "Recordings transferred successfully.");
+    for (i = 0; i < MetricsServersCount; ++i) {
+        housedvr_buffer_printf (output,
+                                "housedvr_transfers_total{server=\"%s\"} %lld\n",
+                                MetricsServers[i].server,
+                                MetricsServers[i].counters.transfers);
+    }
+
+    housedvr_metrics_help (output, "housedvr_transfer_bytes_total", "counter",
+                           "Bytes received.");
+    for (i = 0; i < MetricsServersCount; ++i) {
+        housedvr_buffer_printf (output,
+                                "housedvr_transfer_bytes_total{server=\"%s\"} %lld\n",
+                                MetricsServers[i].server,
+                                MetricsServers[i].counters.bytes);
+    }
+
+    housedvr_metrics_help (output, "housedvr_transfer_failures_total",
+                           "counter", "Failed transfers, by HTTP status.");
+    for (i = 0; i < MetricsServersCount; ++i) {
+        MetricsCounters *counters = &(MetricsServers[i].counters);
+        for (j = 0; j < METRICS_CODES; ++j) {
+            if (!counters->errors[j].count) continue;
+            char code[16];
+            if (counters->errors[j].code)
+                snprintf (code, sizeof(code), "%d", counters->errors[j].code);
+            else
+                snprintf (code, sizeof(code), "other");
+            housedvr_buffer_printf (output,
+                    "housedvr_transfer_failures_total{server=\"%s\",code=\"%s\"} %lld\n",
+                    MetricsServers[i].server, code, counters->errors[j].count);
+        }
+    }
+
+    housedvr_metrics_help (output, "housedvr_notify_rejected_total",
+                           "counter", "Notifications ignored, queue full.");
+    for (i = 0; i < MetricsServersCount; ++i) {
+        housedvr_buffer_printf (output,
+                                "housedvr_notify_rejected_total{server=\"%s\"} %lld\n",
+                                MetricsServers[i].server,
+                                MetricsServers[i].counters.rejected);
+    }
+
+    housedvr_metrics_help (output, "housedvr_transfer_duration_seconds",
+                           "histogram", "Duration of the successful transfers.");
+    for (i = 0; i < MetricsServersCount; ++i) {
+        MetricsCounters *counters = &(MetricsServers[i].counters);
+        const char *server = MetricsServers[i].server;
+        long long cumulated = 0;
+        for (j = 0; j < METRICS_BUCKETS; ++j) {
+            cumulated += counters->histogram[j];
+            if (j < METRICS_BUCKETS - 1)
+                housedvr_buffer_printf (output,
+                        "housedvr_transfer_duration_seconds_bucket{server=\"%s\",le=\"%d\"} %lld\n",
+                        server, MetricsBounds[j], cumulated);
+            else
+                housedvr_buffer_printf (output,
+                        "housedvr_transfer_duration_seconds_bucket{server=\"%s\",le=\"+Inf\"} %lld\n",
+                        server, cumulated);
+        }
+        housedvr_buffer_printf (output,
+                "housedvr_transfer_duration_seconds_sum{server=\"%s\"} %.3f\n"
+                "housedvr_transfer_duration_seconds_count{server=\"%s\"} %lld\n",
+                server, counters->duration / 1000.0,
+                server, counters->transfers);
+    }
+
+    housedvr_metrics_help (output, "housedvr_queue_wait_seconds_total",
+                           "counter", "Time spent waiting in the queue.");
+    for (i = 0; i < MetricsServersCount; ++i) {
+        housedvr_buffer_printf (output,
+                                "housedvr_queue_wait_seconds_total{server=\"%s\"} %.3f\n",
+                                MetricsServers[i].server,
+                                MetricsServers[i].counters.waited / 1000.0);
+    }
+
+    housedvr_metrics_help (output, "housedvr_queue_depth", "gauge",
+                           "Transfers waiting or active.");
+    housedvr_buffer_printf (output, "housedvr_queue_depth %d\n",
+                            MetricsQueue.current);
+    housedvr_metrics_help (output, "housedvr_transfers_active", "gauge",
+                           "Transfers active.");
+    housedvr_buffer_printf (output, "housedvr_transfers_active %d\n",
+                            MetricsQueue.active);
+
+    echttp_content_type_set ("text/plain; version=0.0.4");
+    return output->data;
+}
+
+static const char *dvr_metrics (const char *method, const char *uri,
+                                const char *data, int length) {
+
+    static HouseDvrBuffer Output;
+
+    housedvr_buffer_reset (&Output);
+
+    const char *format = echttp_parameter_get ("format");
+    if (format && (!strcmp (format, "prometheus")))
+        return housedvr_metrics_format_prometheus (&Output);
+    return housedvr_metrics_format_json (&Output);
+}
+
+void housedvr_metrics_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *slow = 0;
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-dvr-slow=", argv[i], &slow);
+    }
+    if (slow) MetricsSlow = atoi(slow) * 1000;
+
+    for (i = 0; i < METRICS_HASH; ++i) MetricsByServer[i] = -1;
+
+    gethostname (MetricsHost, sizeof(MetricsHost));
+    MetricsStarted = time(0);
+
+    housedvr_metrics_route ("/dvr/metrics", dvr_metrics);
+}
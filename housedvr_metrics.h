@@ -0,0 +1,36 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedvr_metrics.h - Collect performance metrics about the transfers.
+ */
+void      housedvr_metrics_initialize (int argc, const char **argv);
+long long housedvr_metrics_clock (void);
+long long housedvr_metrics_microseconds (void);
+void      housedvr_metrics_transfer (const char *server, int status,
+                                     long long bytes,
+                                     long long duration, long long waited);
+void      housedvr_metrics_rejected (const char *server);
+void      housedvr_metrics_queue (time_t now, int depth, int active);
+
+int       housedvr_metrics_phase (const char *name);
+long long housedvr_metrics_elapsed (int phase, long long start);
+int       housedvr_metrics_route (const char *uri, echttp_callback *call);
+int       housedvr_metrics_match (const char *root, echttp_callback *call);
+void      housedvr_metrics_status (HouseDvrBuffer *output);
@@ -0,0 +1,232 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedvr_retention.c - Enforce the retention policy of each camera.
+ *
+ * SYNOPSYS:
+ *
+ * This module limits how much storage each camera may use, and for how
+ * long its recordings are kept. The limits are set per camera, using the
+ * "server:camera" feed names:
+ *
+ *   -dvr-retention=home:front=200G,home:door=30d,home:garage=50G/14d
+ *
+ * A size limit is a number followed by M, G or T (MB if no unit), and an
+ * age limit is a number of days followed by d. A camera without a policy
+ * is not limited, except by the disk cleanup.
+ *
+ * The recordings to delete are chosen from the index (oldest recording
+ * of each camera), without accessing the file system. When several
+ * cameras are over their limits, the recordings past their age limit go
+ * first, then the recordings of the camera most over its size limit.
+ *
+ * void housedvr_retention_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * const char *housedvr_retention_victim (time_t now, long long *size);
+ *
+ *    Return the path and size of the next recording to delete because
+ *    its camera is over its limits, or 0 if there is none. The caller
+ *    must delete the recording and remove it from the index before
+ *    calling this function again.
+ *
+ * void housedvr_retention_status (HouseDvrBuffer *output);
+ *
+ *    Append the state of the retention policies, in JSON.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+
+#include "housedvr_buffer.h"
+#include "housedvr_index.h"
+#include "housedvr_retention.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+typedef struct {
+    char name[128];
+    int source; // Index source, -1 until a recording was indexed.
+    long long bytes; // 0 means no size limit.
+    int days; // 0 means no age limit.
+    long long evicted;
+    int files;
+} RetentionPolicy;
+
+static RetentionPolicy *RetentionPolicies = 0;
+static int RetentionCount = 0;
+
+static long long housedvr_retention_size (const char *text) {
+
+    char *unit;
+    long long value = strtoll (text, &unit, 10);
+    switch (toupper(*unit)) {
+        case 'T': value *= 1024; // Fall through.
+        case 'G': value *= 1024; // Fall through.
+        case 'M':
+        default:  value *= 1024 * 1024;
+    }
+    return value;
+}
+
+static void housedvr_retention_limit (RetentionPolicy *policy,
+                                      const char *text, int length) {
+
+    if (length <= 0) return;
+    if (text[length-1] == 'd' || text[length-1] == 'D') {
+        policy->days = atoi (text);
+    } else {
+        policy->bytes = housedvr_retention_size (text);
+    }
+}
+
+static void housedvr_retention_parse (const char *spec) {
+
+    while (*spec) {
+        const char *end = strchr (spec, ',');
+        if (!end) end = spec + strlen(spec);
+
+        const char *equal = memchr (spec, '=', end - spec);
+        if (equal && (equal > spec) && (equal - spec < 128)) {
+            RetentionPolicies = realloc (RetentionPolicies,
+                              (RetentionCount + 1) * sizeof(RetentionPolicy));
+            RetentionPolicy *policy = RetentionPolicies + RetentionCount++;
+            memset (policy, 0, sizeof(RetentionPolicy));
+            memcpy (policy->name, spec, equal - spec);
+            policy->source = -1;
+
+            const char *limit = equal + 1;
+            const char *slash = memchr (limit, '/', end - limit);
+            if (slash) {
+                housedvr_retention_limit (policy, limit, slash - limit);
+                limit = slash + 1;
+            }
+            housedvr_retention_limit (policy, limit, end - limit);
+            DEBUG ("Retention for %s: %lld MB, %d days\n",
+                   policy->name, policy->bytes / (1024 * 1024), policy->days);
+        } else {
+            houselog_trace (HOUSE_FAILURE, "RETENTION",
+                            "invalid policy %.*s", (int)(end - spec), spec);
+        }
+        spec = (*end) ? end + 1 : end;
+    }
+}
+
+void housedvr_retention_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *spec = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-dvr-retention=", argv[i], &spec);
+    }
+    if (spec) housedvr_retention_parse (spec);
+}
+
+// Return the oldest date (YYYYMMDD) that a recording may have to be kept.
+//
+static int housedvr_retention_cutoff (time_t now, int days) {
+
+    time_t limit = now - ((time_t)days * 86400);
+    struct tm *local = localtime (&limit);
+    if (!local) return 0;
+    return ((local->tm_year + 1900) * 10000)
+           + ((local->tm_mon + 1) * 100) + local->tm_mday;
+}
+
+const char *housedvr_retention_victim (time_t now, long long *size) {
+
+    int i;
+    RetentionPolicy *selected = 0;
+    const char *victim = 0;
+    long long victimsize = 0;
+    double worst = 1.0;
+
+    for (i = 0; i < RetentionCount; ++i) {
+        RetentionPolicy *policy = RetentionPolicies + i;
+        if (policy->source < 0) {
+            policy->source = housedvr_index_source_find (policy->name);
+            if (policy->source < 0) continue;
+        }
+        long long oldestsize;
+        const char *oldest =
+            housedvr_index_source_first (policy->source, &oldestsize);
+        if (!oldest) continue;
+
+        if (policy->days > 0) {
+            int year, month, day;
+            if (sscanf (oldest, "%4d/%2d/%2d", &year, &month, &day) == 3) {
+                int date = (year * 10000) + (month * 100) + day;
+                if (date < housedvr_retention_cutoff (now, policy->days)) {
+                    // Expired recordings always go first.
+                    selected = policy;
+                    victim = oldest;
+                    victimsize = oldestsize;
+                    break;
+                }
+            }
+        }
+        if (policy->bytes > 0) {
+            double ratio = (double)housedvr_index_source_total (policy->source)
+                           / (double)(policy->bytes);
+            if (ratio > worst) {
+                worst = ratio;
+                selected = policy;
+                victim = oldest;
+                victimsize = oldestsize;
+            }
+        }
+    }
+    if (!selected) return 0;
+
+    selected->evicted += victimsize;
+    selected->files += 1;
+    if (size) *size = victimsize;
+    return victim;
+}
+
+void housedvr_retention_status (HouseDvrBuffer *output) {
+
+    int i;
+    const char *sep = "";
+
+    housedvr_buffer_printf (output, "\"retention\":[");
+    for (i = 0; i < RetentionCount; ++i) {
+        RetentionPolicy *policy = RetentionPolicies + i;
+        housedvr_buffer_printf (output,
+                                "%s{\"name\":\"%s\",\"used\":%lld,"
+                                    "\"max\":%lld,\"days\":%d,"
+                                    "\"evicted\":%lld,\"files\":%d}",
+                                sep, policy->name,
+                                housedvr_index_source_total (policy->source),
+                                policy->bytes, policy->days,
+                                policy->evicted, policy->files);
+        sep = ",";
+    }
+    housedvr_buffer_printf (output, "]");
+}
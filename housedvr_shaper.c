@@ -0,0 +1,266 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedvr_shaper.c - Limit the bandwidth used by the transfers.
+ *
+ * SYNOPSYS:
+ *
+ * This module limits the average bandwidth used by the transfers of
+ * recordings, globally and for each CCTV service, using token buckets.
+ *
+ * The data of a transfer is copied by echttp itself, so the pace of one
+ * transfer cannot be controlled here. Instead this module controls when
+ * transfers are allowed to start: each bucket is refilled every second
+ * according to its rate, and a transfer may start only if the buckets
+ * involved are not empty. The size of the transfer is then charged to the
+ * buckets, which may go "in debt": the next transfer has to wait until
+ * that debt has been repaid. Over time this limits the average bandwidth.
+ *
+ * The rates are configured in Mbit/s, with an optional schedule based on
+ * the local time of day:
+ *
+ *   -dvr-rate=50                 Limit all transfers to 50 Mbit/s.
+ *   -dvr-rate=8-18:20,18-8:0     20 Mbit/s from 8am to 6pm, unlimited
+ *                                during the night.
+ *   -dvr-server-rate=...         The same, for each CCTV service.
+ *
+ * A rate of 0 means unlimited. An hour that does not match any period is
+ * unlimited.
+ *
+ * void housedvr_shaper_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * int housedvr_shaper_source (const char *feed);
+ *
+ *    Return the identifier of the bucket for the specified CCTV service.
+ *
+ * int housedvr_shaper_ready (int source);
+ *
+ *    Return 1 if a transfer from the specified CCTV service may start.
+ *
+ * void housedvr_shaper_charge (int source, long long bytes);
+ *
+ *    Record that a transfer of the specified size has started.
+ *
+ * void housedvr_shaper_background (time_t now);
+ *
+ *    Refill the buckets. This is called every second.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <echttp.h>
+#include <echttp_hash.h> // Just for the signature.
+
+#include "houselog.h"
+
+#include "housedvr_shaper.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define SHAPER_PERIODS 8
+
+typedef struct {
+    int count;
+    struct {
+        int start; // Hour.
+        int end;   // Hour.
+        long long rate; // Bytes per second, 0 for unlimited.
+    } period[SHAPER_PERIODS];
+} ShaperSchedule;
+
+static ShaperSchedule ShaperGlobalSchedule;
+static ShaperSchedule ShaperServerSchedule;
+
+static long long ShaperGlobalRate = 0;
+static long long ShaperServerRate = 0;
+
+typedef struct {
+    long long tokens; // Bytes. Negative when in debt.
+} ShaperBucket;
+
+static ShaperBucket ShaperGlobal;
+
+// The per-server buckets, indexed by an hash table with chaining.
+// The CCTV services come and go rarely, so entries are never removed.
+//
+#define SHAPER_HASH 64 // Must be a power of 2.
+
+typedef struct {
+    char feed[128];
+    unsigned int signature;
+    int next;
+    ShaperBucket bucket;
+} ShaperSource;
+
+static ShaperSource *ShaperSources = 0;
+static int           ShaperSourcesCount = 0;
+static int           ShaperSourcesSize = 0;
+
+static int ShaperBySource[SHAPER_HASH];
+
+
+static void housedvr_shaper_parse (ShaperSchedule *schedule,
+                                   const char *spec) {
+
+    schedule->count = 0;
+    if (!spec) return;
+
+    while (*spec && (schedule->count < SHAPER_PERIODS)) {
+        int start = 0;
+        int end = 0;
+        const char *rate = strchr (spec, ':');
+        const char *next = strchr (spec, ',');
+        if (rate && ((!next) || (rate < next))) {
+            start = atoi (spec);
+            const char *dash = strchr (spec, '-');
+            if (dash && dash < rate) end = atoi (dash + 1);
+            else end = start;
+            rate += 1;
+        } else {
+            rate = spec; // No period: all day.
+        }
+        if ((start < 0) || (start > 23) || (end < 0) || (end > 23)) {
+            houselog_trace (HOUSE_FAILURE, "SHAPER", "invalid period %s", spec);
+        } else {
+            int i = schedule->count++;
+            schedule->period[i].start = start;
+            schedule->period[i].end = end;
+            schedule->period[i].rate = (atoll (rate) * 1000000) / 8;
+        }
+        if (!next) break;
+        spec = next + 1;
+    }
+}
+
+static long long housedvr_shaper_rate (const ShaperSchedule *schedule,
+                                       int hour) {
+    int i;
+    for (i = 0; i < schedule->count; ++i) {
+        int start = schedule->period[i].start;
+        int end = schedule->period[i].end;
+        if (start == end) return schedule->period[i].rate;
+        if (start < end) {
+            if ((hour >= start) && (hour < end))
+                return schedule->period[i].rate;
+        } else if ((hour >= start) || (hour < end)) {
+            return schedule->period[i].rate;
+        }
+    }
+    return 0;
+}
+
+static void housedvr_shaper_refill (ShaperBucket *bucket,
+                                    long long rate, int elapsed) {
+
+    if (!rate) {
+        bucket->tokens = 0; // Unlimited: forget any debt.
+        return;
+    }
+    bucket->tokens += rate * elapsed;
+    if (bucket->tokens > rate) bucket->tokens = rate; // One second burst.
+}
+
+int housedvr_shaper_source (const char *feed) {
+
+    unsigned int signature = echttp_hash_signature (feed);
+    int *bucket = ShaperBySource + (signature & (SHAPER_HASH - 1));
+
+    int i;
+    for (i = *bucket; i >= 0; i = ShaperSources[i].next) {
+        if (ShaperSources[i].signature != signature) continue;
+        if (!strcmp (ShaperSources[i].feed, feed)) return i;
+    }
+
+    if (ShaperSourcesCount >= ShaperSourcesSize) {
+        ShaperSourcesSize += 16;
+        ShaperSources = realloc (ShaperSources,
+                                 ShaperSourcesSize * sizeof(ShaperSource));
+        if (!ShaperSources) {
+            ShaperSourcesCount = ShaperSourcesSize = 0;
+            return -1;
+        }
+    }
+    i = ShaperSourcesCount++;
+    memset (ShaperSources + i, 0, sizeof(ShaperSource));
+    snprintf (ShaperSources[i].feed, sizeof(ShaperSources[i].feed), "%s", feed);
+    ShaperSources[i].signature = signature;
+    ShaperSources[i].next = *bucket;
+    *bucket = i;
+    return i;
+}
+
+int housedvr_shaper_ready (int source) {
+
+    if (ShaperGlobalRate && (ShaperGlobal.tokens <= 0)) return 0;
+    if (ShaperServerRate && (source >= 0) && (source < ShaperSourcesCount)) {
+        if (ShaperSources[source].bucket.tokens <= 0) return 0;
+    }
+    return 1;
+}
+
+void housedvr_shaper_charge (int source, long long bytes) {
+
+    if (ShaperGlobalRate) ShaperGlobal.tokens -= bytes;
+    if (ShaperServerRate && (source >= 0) && (source < ShaperSourcesCount)) {
+        ShaperSources[source].bucket.tokens -= bytes;
+    }
+}
+
+void housedvr_shaper_background (time_t now) {
+
+    static time_t LastRefill = 0;
+
+    if (now <= LastRefill) return;
+    int elapsed = (LastRefill > 0) ? (int)(now - LastRefill) : 1;
+    LastRefill = now;
+
+    struct tm local;
+    localtime_r (&now, &local);
+    ShaperGlobalRate = housedvr_shaper_rate (&ShaperGlobalSchedule, local.tm_hour);
+    ShaperServerRate = housedvr_shaper_rate (&ShaperServerSchedule, local.tm_hour);
+
+    housedvr_shaper_refill (&ShaperGlobal, ShaperGlobalRate, elapsed);
+
+    int i;
+    for (i = 0; i < ShaperSourcesCount; ++i) {
+        housedvr_shaper_refill (&(ShaperSources[i].bucket),
+                                ShaperServerRate, elapsed);
+    }
+}
+
+void housedvr_shaper_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *global = 0;
+    const char *server = 0;
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-dvr-rate=", argv[i], &global);
+        echttp_option_match ("-dvr-server-rate=", argv[i], &server);
+    }
+    housedvr_shaper_parse (&ShaperGlobalSchedule, global);
+    housedvr_shaper_parse (&ShaperServerSchedule, server);
+
+    for (i = 0; i < SHAPER_HASH; ++i) ShaperBySource[i] = -1;
+}
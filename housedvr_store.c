@@ -29,7 +29,54 @@
  * reflected in the web user's interface.
  *
  * That module is also in charge of managing the disk space, i.e. delete
- * the oldest recording when the disk is getting too full.
+ * the oldest recording when the disk is getting too full. The amount of
+ * space to free is calculated when the disk is found too full, and the
+ * oldest recordings are then deleted a few files at a time, so that the
+ * HTTP service and the transfers are not blocked for long.
+ *
+ * The disk usage is read every minute. In between, it is estimated from
+ * the amount of data added to the index, which also gives the ingest
+ * rate. This is used to start the cleanup before the limit is actually
+ * reached, freeing enough space for the data expected until the next disk
+ * check, and to predict when the disk would become full.
+ *
+ * The recordings may be stored on two tiers: the main storage (-dvr-store),
+ * where the new recordings are written, and an optional archive
+ * (-dvr-archive), typically a larger and slower disk. The recordings
+ * older than a number of days (-dvr-archive-after, default 7) are
+ * migrated to the archive in the background, one file at a time and at a
+ * limited rate (-dvr-archive-rate, in MB/s, default 16) so that the disks
+ * remain available for the transfers and the web clients. A day is also
+ * migrated early when the main storage is over the cleanup limit. The
+ * files are copied using copy_file_range(), with a read/write fallback,
+ * and keep their modification time. Both tiers are merged into a single
+ * namespace: the index knows on which tier each recording is stored.
+ * The disk cleanup applies to the archive, where the oldest recordings
+ * are.
+ *
+ * The retention policy of each camera (see housedvr_retention.c) is
+ * enforced here too: the recordings of a camera that is over its limits
+ * are deleted a few at a time, and these are the first to go when the
+ * disk is too full.
+ *
+ * The day view shows the "title" image of each recordings. In order to
+ * avoid one HTTP request per image, the images of one day can be retrieved
+ * all at once as a concatenation of the JPEG files (/dvr/storage/thumbnails).
+ * The daily list provides the offset and length of each image in that
+ * concatenation. The concatenation is stored as a hidden file in the day's
+ * directory: it is generated on demand, and regenerated only after a new
+ * recording was added to that day.
+ *
+ * The recordings can also be searched by camera and time range, without
+ * navigating the calendar (/dvr/storage/search). The search is answered
+ * from the index, and the result is returned by pages.
+ *
+ * The recordings themselves are served by this module too, instead of
+ * using the generic echttp static route, in order to support byte range
+ * requests (needed for moving within a long video), and caching: each
+ * file has an entity tag derived from its size and modification time,
+ * and the files from past days, which will not change anymore, are marked
+ * as immutable.
  *
  * TBD: TV recording would also be organized by shows. The plan is to
  * eventually implement this feature as a filter tag.
@@ -43,16 +90,24 @@
  *    Return the path to the recordings root directory. This is used to
  *    share the same default and selected value with the transfer module.
  *
+ * const char *housedvr_store_archive (void);
+ *
+ *    Return the path to the archive root directory, or 0 if there is
+ *    no archive.
+ *
  * void housedvr_store_background (time_t now);
  *
  *    The periodic function that manages the video storage.
  *
- * int housedvr_store_status (char *buffer, int size);
+ * void housedvr_store_status (HouseDvrBuffer *output);
  *
- *    A function that populates a status overview of the storage in JSON.
+ *    A function that appends a status overview of the storage in JSON.
+ *    The JSON text is cached, and refreshed every few seconds.
  *
  */
 
+#define _GNU_SOURCE // For copy_file_range().
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -63,6 +118,9 @@
 #include <sys/statvfs.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 
 #include <echttp.h>
 #include <echttp_static.h>
@@ -71,40 +129,120 @@
 #include "houselog.h"
 #include "housediscover.h"
 
+#include "housedvr_buffer.h"
 #include "housedvr_store.h"
+#include "housedvr_index.h"
+#include "housedvr_metrics.h"
+#include "housedvr_retention.h"
+#include "housedvr_transfer.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
 static int HouseDvrMaxSpace = 0; // Default is no automatic cleanup.
 
 static const char *HouseDvrStorage = "/storage/motion/videos";
+static const char *HouseDvrArchive = 0;
 static const char *HouseDvrUri =     "/dvr/storage/videos";
 
+static int HouseDvrArchiveAfter = 7; // Days.
+static long long HouseDvrArchiveRate = 16 * 1024 * 1024; // Bytes per second.
+#define DVR_MIGRATE_CHUNK (1024 * 1024) // Maximum bytes copied per call.
+
+#define DVR_STATUS_PERIOD 5 // Seconds between two storage status updates.
+
+// The state of the ongoing (or last) disk cleanup.
+//
+#define DVR_CLEANUP_BATCH 8 // Maximum number of files deleted per second.
+
+static struct {
+    int active;
+    time_t started;
+    long long budget; // Number of bytes to free.
+    long long freed;
+    int files;
+    int date; // YYYYMMDD, the day being cleaned up.
+} DvrCleanup;
+
+// The disk usage, as of the last check, and the ingest rate history.
+//
+#define DVR_CHECK_PERIOD 60
+#define DVR_INGEST_SAMPLES 60 // One hour of history.
+
+static struct {
+    long long total;
+    long long used;
+    long long ingested; // The index count at the time of the check.
+} DvrDisk;
+
+static long long DvrIngest[DVR_INGEST_SAMPLES];
+static time_t DvrIngestTime[DVR_INGEST_SAMPLES];
+static int DvrIngestCount = 0;
+static int DvrIngestCursor = 0;
+
+static int DvrMainUsed = 0; // Percentage, when there is an archive.
+
+// The state of the ongoing migration to the archive. Only one file is
+// copied at a time.
+//
+static struct {
+    int date; // YYYYMMDD, the day being migrated, or 0.
+    char path[512]; // The file being copied, relative to the roots.
+    int in;
+    int out;
+    int files;
+    long long bytes;
+    time_t started;
+    time_t retry; // When to restart after an error.
+} DvrMigration = {0, "", -1, -1, 0, 0, 0, 0};
+
 
 const char *housedvr_store_root (void) {
     return HouseDvrStorage;
 }
 
+const char *housedvr_store_archive (void) {
+    return HouseDvrArchive;
+}
+
+// Return the local date (YYYYMMDD) for the specified time.
+//
+static int housedvr_store_date (time_t t) {
+
+    struct tm *local = localtime (&t);
+    if (!local) return 0;
+    return ((local->tm_year + 1900) * 10000)
+           + ((local->tm_mon + 1) * 100) + local->tm_mday;
+}
+
+// Build the full path of a recording, on whatever tier it is stored.
+//
+static void housedvr_store_path (char *buffer, int size, const char *relative) {
+
+    const char *root = HouseDvrStorage;
+    if (HouseDvrArchive && (housedvr_index_tier (relative) == 1))
+        root = HouseDvrArchive;
+    snprintf (buffer, size, "%s/%s", root, relative);
+}
+
+// The top, yearly and monthly requests are answered from the calendar
+// maintained by the index module, without accessing the file system.
+//
 static const char *dvr_store_top (const char *method, const char *uri,
                                         const char *data, int length) {
     static char buffer[2048];
 
-    int  cursor = 0;
-    const char *sep = "[";
+    int  years[256];
+    int  count = housedvr_index_years (years, 256);
+    int  cursor;
+    int  i;
+    const char *sep = "";
 
-    DIR *dir = opendir (HouseDvrStorage);
-    if (dir) {
-        struct dirent *p = readdir(dir);
-        while (p) {
-            if ((p->d_type == DT_DIR) && (isdigit(p->d_name[0]))) {
-                cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
-                                    "%s%s", sep, p->d_name);
-                if (cursor >= sizeof(buffer)) goto nospace;
-                sep = ",";
-            }
-            p = readdir(dir);
-        }
-        closedir (dir);
+    cursor = snprintf (buffer, sizeof(buffer), "[");
+    for (i = 0; i < count; ++i) {
+        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
+                            "%s%d", sep, years[i]);
+        if (cursor >= sizeof(buffer)) goto nospace;
+        sep = ",";
     }
     cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "]");
     if (cursor >= sizeof(buffer)) goto nospace;
@@ -120,27 +258,20 @@ static const char *dvr_store_yearly (const char *method, const char *uri,
                                            const char *data, int length) {
     static char buffer[2048];
 
-    char path[1024];
-    int  tail;
     int  cursor;
     int  month;
 
     const char *year = echttp_parameter_get("year");
-
-    tail = snprintf (path, sizeof(path), "%s/%d",
-                     HouseDvrStorage, atoi(year));
+    if (!year) {
+        echttp_error (404, "Not Found");
+        return "";
+    }
+    unsigned int months = housedvr_index_months (atoi(year));
 
     cursor = snprintf (buffer, sizeof(buffer), "[false");
 
     for (month = 1; month <= 12; ++month) {
-        const char *found = ",false";
-        struct stat info;
-        snprintf (path+tail, sizeof(path)-tail, "%02d", month);
-        if (!stat (path, &info)) {
-            if ((info.st_mode & S_IFMT) != S_IFDIR) {
-                found = ",true";
-            }
-        }
+        const char *found = (months & (1u << month)) ? ",true" : ",false";
         cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "%s", found);
         if (cursor >= sizeof(buffer)) goto nospace;
     }
@@ -187,20 +318,11 @@ static const char *dvr_store_monthly (const char *method, const char *uri,
     cursor = snprintf (buffer, sizeof(buffer), "[false");
 
     int referencemonth = local.tm_mon;
-    struct stat info;
-    char path[1024];
-    int  tail = snprintf (path, sizeof(path), "%s/%s/%02d/",
-                          HouseDvrStorage, year, local.tm_mon+1);
+    unsigned int days = housedvr_index_days (atoi(year), local.tm_mon+1);
 
     for (i = 1; i <= 31; ++i) {
-        const char *found = ",false";
-        snprintf (path+tail, sizeof(path)-tail, "%02d", local.tm_mday);
-        if (!stat (path, &info)) {
-            if ((info.st_mode & S_IFMT) == S_IFDIR) {
-                found = ",true";
-            }
-        }
-        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, found);
+        const char *found = (days & (1u << local.tm_mday)) ? ",true" : ",false";
+        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "%s", found);
         if (cursor >= sizeof(buffer)) goto nospace;
 
         base += 24*60*60;
@@ -217,35 +339,75 @@ nospace:
     return "HTTP Error 413: Out of space, response too large";
 }
 
-static const char *dvr_store_daily (const char *method, const char *uri,
-                                          const char *data, int length) {
-    static char buffer[131072];
+// The list of recordings for one day is kept in a cache, which is
+// invalidated when a transfer into that day completes, as reported by
+// the index module. Past days do not change anymore, so their entries
+// remain valid until evicted. The cache is limited to a fixed number of
+// days, the least recently used day being evicted first.
+//
+// Each cached list is tagged with an entity tag, so that a client (e.g.
+// a browser that keeps polling today's list) can skip the transfer if
+// the list did not change.
+//
+#define DVR_DAILY_CACHE 32
+
+typedef struct {
+    int date; // YYYYMMDD
+    int generation;
+    time_t used;
+    char etag[64];
+    HouseDvrBuffer json;
+    HouseDvrBuffer images; // "length name" lines, in the thumbnails order.
+    int thumbnails; // The generation of the thumbnails file, or -1.
+} DvrDailyCache;
+
+#define DVR_THUMBNAILS ".thumbnails"
+
+// The thumbnails of each day are cached in a hidden directory of the main
+// storage, not in the day directory: writing there would change the day
+// directory's modification time, and the index snapshot would then have
+// to read that day again at the next startup.
+//
+static int dvr_store_thumbnails_path (char *path, int size, int date) {
+    return snprintf (path, size, "%s/%s/%d",
+                     HouseDvrStorage, DVR_THUMBNAILS, date) < size;
+}
+
+static void dvr_store_thumbnails_forget (int date) {
+    char path[1024];
+    if (dvr_store_thumbnails_path (path, sizeof(path), date)) unlink (path);
+}
+
+
+static DvrDailyCache DvrDaily[DVR_DAILY_CACHE];
+static time_t DvrStarted = 0;
+
+// List the recordings of one day found on one storage tier. A recording
+// that is being migrated may briefly exist on both tiers: only the copy
+// on the tier known to the index is listed.
+//
+static int dvr_store_daily_scan (HouseDvrBuffer *json, HouseDvrBuffer *images,
+                                 int tier, int year, int month, int day,
+                                 const char **sep, long long *offset) {
 
     char path[1024];
+    char relative[1024];
     int  tail;
     char vuri[1024];
     struct stat info;
 
-    int  cursor;
-    const char *year = echttp_parameter_get("year");
-    const char *month = echttp_parameter_get("month");
-    const char *day = echttp_parameter_get("day");
+    const char *root = tier ? HouseDvrArchive : HouseDvrStorage;
+    if (!root) return 0;
 
-    if (month[0] == '0') month += 1;
-    if (day[0] == '0') day += 1;
-
-    tail = snprintf (path, sizeof(path), "%s/%s/%02d/%02d",
-                     HouseDvrStorage, year, atoi(month), atoi(day));
+    snprintf (path, sizeof(path), "%s/%d/%02d/%02d",
+              root, year, month, day);
     DIR *dir = opendir (path);
-    if (!dir) {
-        echttp_error (404, "Not Found");
-        return "";
-    }
-    snprintf (vuri, sizeof(vuri), "%s/%s/%02d/%02d",
-              HouseDvrUri, year, atoi(month), atoi(day));
+    if (!dir) return 0;
 
-    const char *sep = "";
-    cursor = snprintf (buffer, sizeof(buffer), "[");
+    tail = snprintf (relative, sizeof(relative), "%d/%02d/%02d/",
+                     year, month, day);
+    snprintf (vuri, sizeof(vuri), "%s/%d/%02d/%02d",
+              HouseDvrUri, year, month, day);
 
     for (;;) {
         char name[1024];
@@ -269,7 +431,11 @@ static const char *dvr_store_daily (const char *method, const char *uri,
         s = strrchr(src, ':');
         if (s) *s = 0;
 
-        snprintf (path+tail, sizeof(path)-tail, "/%s", p->d_name);
+        snprintf (relative+tail, sizeof(relative)-tail, "%s", p->d_name);
+        int indexed = housedvr_index_tier (relative);
+        if ((indexed >= 0) && (indexed != tier)) continue;
+
+        housedvr_store_path (path, sizeof(path), relative);
         info.st_size = 0;
         stat (path, &info);
 
@@ -278,45 +444,579 @@ static const char *dvr_store_daily (const char *method, const char *uri,
         s = strrchr (image, '.');
         if (s) snprintf (s, sizeof(image)-(s-image), "%s", ".jpg");
 
-        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
+        housedvr_buffer_printf (json,
                             "%s{\"src\":\"%s\",\"time\":\"%s\",\"size\":%ld"
-                                ",\"video\":\"%s/%s\",\"image\":\"%s/%s\"}",
-                            sep, src, dtime, (long)(info.st_size),
+                                ",\"video\":\"%s/%s\",\"image\":\"%s/%s\"",
+                            *sep, src, dtime, (long)(info.st_size),
                             vuri, p->d_name, vuri, image); 
-        sep = ",";
-        if (cursor >= sizeof(buffer)) goto nospace;
+        *sep = ",";
+
+        // The image's position in the day's thumbnails file, if any.
+        if (snprintf (relative+tail, sizeof(relative)-tail, "%s", image)
+                >= sizeof(relative)-tail) info.st_size = 0;
+        else {
+            housedvr_store_path (path, sizeof(path), relative);
+            if (stat (path, &info)) info.st_size = 0;
+        }
+        if (info.st_size > 0) {
+            housedvr_buffer_printf (json, ",\"thumbnail\":[%lld,%ld]",
+                                    *offset, (long)(info.st_size));
+            housedvr_buffer_printf (images, "%ld %s\n",
+                                    (long)(info.st_size), image);
+            *offset += info.st_size;
+        }
+        housedvr_buffer_printf (json, "}");
+    }
+    closedir(dir);
+    return 1;
+}
+
+static int dvr_store_daily_build (HouseDvrBuffer *json,
+                                  HouseDvrBuffer *images,
+                                  int year, int month, int day) {
+
+    const char *sep = "";
+    long long offset = 0;
+    housedvr_buffer_reset (json);
+    housedvr_buffer_printf (json, "[");
+    housedvr_buffer_reset (images);
+
+    int found = dvr_store_daily_scan (json, images, 0, year, month, day,
+                                      &sep, &offset);
+    found |= dvr_store_daily_scan (json, images, 1, year, month, day,
+                                   &sep, &offset);
+    housedvr_buffer_printf (json, "]");
+    return found;
+}
+
+// Return the up-to-date cache entry for the day specified by the HTTP
+// parameters, or 0 if that day does not exist.
+//
+static DvrDailyCache *dvr_store_daily_get (int *y, int *m, int *d) {
+
+    int i;
+    const char *year = echttp_parameter_get("year");
+    const char *month = echttp_parameter_get("month");
+    const char *day = echttp_parameter_get("day");
+
+    if (!year || !month || !day) return 0;
+    if (month[0] == '0') month += 1;
+    if (day[0] == '0') day += 1;
+
+    *y = atoi(year);
+    *m = atoi(month);
+    *d = atoi(day);
+    int date = (*y * 10000) + (*m * 100) + *d;
+    int generation = housedvr_index_generation (*y, *m, *d);
+
+    DvrDailyCache *entry = 0;
+    DvrDailyCache *oldest = DvrDaily;
+    for (i = 0; i < DVR_DAILY_CACHE; ++i) {
+        if (DvrDaily[i].date == date) {
+            entry = DvrDaily + i;
+            break;
+        }
+        if (DvrDaily[i].used < oldest->used) oldest = DvrDaily + i;
     }
 
-    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "]");
-    if (cursor >= sizeof(buffer)) goto nospace;
+    if ((!entry) || (entry->generation != generation)) {
+        if (!entry) entry = oldest;
+        entry->date = 0;
+        if (!dvr_store_daily_build (&(entry->json),
+                                    &(entry->images), *y, *m, *d)) return 0;
+        entry->date = date;
+        entry->generation = generation;
+        entry->thumbnails = -1;
+        snprintf (entry->etag, sizeof(entry->etag), "\"%lx-%d-%d\"",
+                  (long)DvrStarted, date, generation);
+    }
+    entry->used = time(0);
+    return entry;
+}
 
-    closedir(dir);
+static const char *dvr_store_daily (const char *method, const char *uri,
+                                          const char *data, int length) {
+
+    int y, m, d;
+    DvrDailyCache *entry = dvr_store_daily_get (&y, &m, &d);
+    if (!entry) {
+        echttp_error (404, "Not Found");
+        return "";
+    }
+
+    echttp_attribute_set ("Cache-Control", "no-cache");
+    echttp_attribute_set ("ETag", entry->etag);
+    const char *match = echttp_attribute_get ("If-None-Match");
+    if (match && (!strcmp (match, entry->etag))) {
+        echttp_error (304, "Not Modified");
+        return "";
+    }
     echttp_content_type_json();
-    return buffer;
+    return entry->json.data;
+}
 
-nospace:
-    closedir(dir);
-    echttp_error (413, "Out Of Space");
-    return "HTTP Error 413: Out of space, response too large";
+// Copy exactly the specified number of bytes from one image file to the
+// thumbnails file, so that the offsets in the daily list remain valid
+// even if the image changed in between (padding with zeroes if needed).
+//
+static int dvr_store_thumbnails_copy (int out, const char *path, long length) {
+
+    static char buffer[65536];
+
+    int in = open (path, O_RDONLY);
+    while (length > 0) {
+        int size = (length > sizeof(buffer)) ? sizeof(buffer) : (int)length;
+        int got = (in >= 0) ? read (in, buffer, size) : 0;
+        if (got <= 0) {
+            memset (buffer, 0, size);
+            got = size;
+        }
+        if (write (out, buffer, got) != got) {
+            if (in >= 0) close (in);
+            return 0;
+        }
+        length -= got;
+    }
+    if (in >= 0) close (in);
+    return 1;
+}
+
+static int dvr_store_thumbnails_build (DvrDailyCache *entry,
+                                       int year, int month, int day) {
+
+    char path[1024];
+    char temp[1024];
+    char relative[1024];
+    char image[1024];
+
+    int tail = snprintf (relative, sizeof(relative), "%d/%02d/%02d/",
+                         year, month, day);
+
+    // The relative path is reused for each image: build the names first.
+    int date = (year * 10000) + (month * 100) + day;
+    if (!dvr_store_thumbnails_path (path, sizeof(path), date)) return 0;
+    if (snprintf (temp, sizeof(temp), "%s.part", path) >= sizeof(temp))
+        return 0;
+    snprintf (image, sizeof(image), "%s/%s", HouseDvrStorage, DVR_THUMBNAILS);
+    mkdir (image, 0755); // Might already exist.
+    int out = open (temp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (out < 0) return 0;
+
+    const char *line = entry->images.data;
+    while (line && *line) {
+        char *name;
+        long length = strtol (line, &name, 10);
+        const char *eol = strchr (name, '\n');
+        if (!eol) break;
+        if (*name == ' ') name += 1;
+        snprintf (relative+tail, sizeof(relative)-tail,
+                  "%.*s", (int)(eol - name), name);
+        housedvr_store_path (image, sizeof(image), relative);
+        if (!dvr_store_thumbnails_copy (out, image, length)) {
+            close (out);
+            unlink (temp);
+            return 0;
+        }
+        line = eol + 1;
+    }
+    close (out);
+
+    if (rename (temp, path)) {
+        unlink (temp);
+        return 0;
+    }
+    return 1;
+}
+
+static const char *dvr_store_thumbnails (const char *method, const char *uri,
+                                         const char *data, int length) {
+
+    char path[1024];
+    char etag[80];
+    struct stat info;
+
+    int y, m, d;
+    DvrDailyCache *entry = dvr_store_daily_get (&y, &m, &d);
+    if (!entry) {
+        echttp_error (404, "Not Found");
+        return "";
+    }
+
+    if (entry->thumbnails != entry->generation) {
+        if (!dvr_store_thumbnails_build (entry, y, m, d)) {
+            echttp_error (500, "Cannot generate the thumbnails");
+            return "";
+        }
+        entry->thumbnails = entry->generation;
+    }
+    dvr_store_thumbnails_path (path, sizeof(path), (y * 10000) + (m * 100) + d);
+
+    // The thumbnails match the daily list: use the same entity tag.
+    snprintf (etag, sizeof(etag), "%.*s-t\"",
+              (int)strlen(entry->etag) - 1, entry->etag);
+    echttp_attribute_set ("Cache-Control", "no-cache");
+    echttp_attribute_set ("ETag", etag);
+    const char *match = echttp_attribute_get ("If-None-Match");
+    if (match && (!strcmp (match, etag))) {
+        echttp_error (304, "Not Modified");
+        return "";
+    }
+
+    int fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        echttp_error (404, "Not Found");
+        return "";
+    }
+    if (fstat (fd, &info)) {
+        close (fd);
+        echttp_error (500, "Cannot access the thumbnails");
+        return "";
+    }
+    echttp_content_type_set ("application/octet-stream");
+    echttp_transfer (fd, info.st_size);
+    return "";
+}
+
+// Convert a search time parameter into a YYYYMMDDHHMMSS key, in local
+// time. The parameter is either a number of seconds since the epoch, or a
+// local date and time in the YYYY-MM-DD[THH:MM[:SS]] format.
+//
+static long long dvr_store_search_key (const char *value, time_t fallback) {
+
+    int year = 0, month = 0, day = 0;
+    int hour = 0, minute = 0, second = 0;
+
+    if (value && strchr (value, '-')) {
+        if (sscanf (value, "%d-%d-%dT%d:%d:%d",
+                    &year, &month, &day, &hour, &minute, &second) < 3)
+            return -1;
+    } else {
+        time_t t = value ? (time_t)atoll(value) : fallback;
+        struct tm *local = localtime (&t);
+        if (!local) return -1;
+        year = local->tm_year + 1900;
+        month = local->tm_mon + 1;
+        day = local->tm_mday;
+        hour = local->tm_hour;
+        minute = local->tm_min;
+        second = local->tm_sec;
+    }
+    return (((year * 10000LL) + (month * 100) + day) * 1000000LL)
+           + (hour * 10000) + (minute * 100) + second;
+}
+
+// Decode the path of a recording: return its YYYYMMDDHHMMSS key, or -1 if
+// this is not a video file. The time of day is the first six digits of the
+// TIME part of the TIME-SOURCE[:NUMBER].EXTENSION name.
+//
+static long long dvr_store_search_decode (const char *path, const char **name) {
+
+    int year, month, day;
+    int length = 0;
+    if (sscanf (path, "%4d/%2d/%2d/%n", &year, &month, &day, &length) < 3)
+        return -1;
+    if (length <= 0) return -1;
+    *name = path + length;
+
+    const char *ext = strrchr (*name, '.');
+    if ((!ext) || (strcmp (ext, ".mkv") && strcmp (ext, ".mp4") &&
+                   strcmp (ext, ".avi"))) return -1;
+
+    const char *dash = strchr (*name, '-');
+    if (!dash) return -1; // Not a TIME-SOURCE name.
+
+    long long time = 0;
+    int digits = 0;
+    const char *p;
+    for (p = *name; (p < dash) && (digits < 6); ++p) {
+        if (isdigit(*p)) {
+            time = (time * 10) + (*p - '0');
+            digits += 1;
+        }
+    }
+    while (digits++ < 6) time *= 10;
+
+    return (((year * 10000LL) + (month * 100) + day) * 1000000LL) + time;
+}
+
+#define DVR_SEARCH_LIMIT 1000
+
+static const char *dvr_store_search (const char *method, const char *uri,
+                                     const char *data, int length) {
+
+    static HouseDvrBuffer Result;
+
+    const char *src = echttp_parameter_get ("src");
+    const char *offsetparam = echttp_parameter_get ("offset");
+    const char *limitparam = echttp_parameter_get ("limit");
+
+    time_t now = time(0);
+    long long from = dvr_store_search_key (echttp_parameter_get ("from"), 0);
+    long long to = dvr_store_search_key (echttp_parameter_get ("to"), now);
+    if ((from < 0) || (to < 0)) {
+        echttp_error (400, "Invalid time range");
+        return "";
+    }
+    int offset = offsetparam ? atoi (offsetparam) : 0;
+    if (offset < 0) offset = 0;
+    int limit = limitparam ? atoi (limitparam) : 100;
+    if ((limit <= 0) || (limit > DVR_SEARCH_LIMIT)) limit = DVR_SEARCH_LIMIT;
+
+    int source = -1;
+    if (src && *src) {
+        source = housedvr_index_source_find (src);
+    }
+
+    housedvr_buffer_reset (&Result);
+    housedvr_buffer_printf (&Result,
+                            "{\"from\":%lld,\"to\":%lld,\"offset\":%d,"
+                                "\"recordings\":[", from, to, offset);
+
+    int count = 0;
+    int more = 0;
+    if ((source >= 0) || (!src) || (!*src)) {
+        long long cursor = 0;
+        long long size;
+        const char *sep = "";
+        int skip = offset;
+        const char *path;
+        while ((path = housedvr_index_enumerate
+                           (source, (int)(from / 1000000), &cursor, &size))) {
+            const char *name;
+            long long key = dvr_store_search_decode (path, &name);
+            if (key < 0) continue;
+            if (key > to) {
+                if (key / 1000000 > to / 1000000) break; // Chronological.
+                continue;
+            }
+            if (key < from) continue;
+            if (skip > 0) {
+                skip -= 1;
+                continue;
+            }
+            if (count >= limit) {
+                more = 1;
+                break;
+            }
+            // Same format as the daily list.
+            const char *dash = strchr (name, '-');
+            const char *number = strrchr (dash + 1, ':');
+            const char *ext = strrchr (dash + 1, '.');
+            const char *end = (number && number < ext) ? number : ext;
+            int base = ext - path;
+            housedvr_buffer_printf (&Result,
+                                    "%s{\"src\":\"%.*s\",\"time\":\"%.*s\","
+                                        "\"date\":\"%.*s\",\"size\":%lld,"
+                                        "\"video\":\"%s/%s\","
+                                        "\"image\":\"%s/%.*s.jpg\"}",
+                                    sep, (int)(end - dash - 1), dash + 1,
+                                    (int)(dash - name), name,
+                                    (int)(name - path - 1), path, size,
+                                    HouseDvrUri, path, HouseDvrUri, base, path);
+            sep = ",";
+            count += 1;
+        }
+    }
+    housedvr_buffer_printf (&Result, "],\"count\":%d,\"more\":%s}",
+                            count, more ? "true" : "false");
+    echttp_content_type_json();
+    return Result.data;
+}
+
+static const char *dvr_store_video_type (const char *path) {
+
+    const char *ext = strrchr (path, '.');
+    if (!ext) return "application/octet-stream";
+    ext += 1;
+    if (!strcmp (ext, "mp4")) return "video/mp4";
+    if (!strcmp (ext, "mkv")) return "video/x-matroska";
+    if (!strcmp (ext, "avi")) return "video/x-msvideo";
+    if (!strcmp (ext, "jpg")) return "image/jpeg";
+    return "application/octet-stream";
+}
+
+// Decode a single range "bytes=START-END", "bytes=START-" or "bytes=-LAST".
+// Return 1 if valid, 0 if not satisfiable, -1 if the range should be
+// ignored (not supported, or invalid).
+//
+static int dvr_store_video_range (const char *range, long long size,
+                                  long long *start, long long *end) {
+
+    if (strncmp (range, "bytes=", 6)) return -1;
+    range += 6;
+    if (strchr (range, ',')) return -1; // Multiple ranges: not supported.
+
+    char *next;
+    if (range[0] == '-') {
+        if (!isdigit (range[1])) return -1; // Invalid: ignore.
+        long long last = strtoll (range+1, &next, 10);
+        if (*next) return -1;
+        if (last <= 0) return 0;
+        if (last > size) last = size;
+        *start = size - last;
+        *end = size - 1;
+    } else {
+        if (!isdigit (range[0])) return -1; // Invalid: ignore.
+        *start = strtoll (range, &next, 10);
+        if (*next != '-') return -1;
+        if (next[1]) {
+            if (!isdigit (next[1])) return -1;
+            *end = strtoll (next+1, &next, 10);
+            if (*next) return -1;
+            if (*end < *start) return -1; // Invalid: ignore (RFC 7233).
+            if (*end >= size) *end = size - 1;
+        } else {
+            *end = size - 1;
+        }
+    }
+    if ((*start >= size) || (*start > *end)) return 0;
+    return 1;
+}
+
+// Return the date (YYYYMMDD) of a "/YYYY/MM/DD/..." path, or 0 if the
+// path is not dated (the Today and Yesterday links, for example).
+//
+static int dvr_store_video_date (const char *relative) {
+
+    int i;
+    static const char pattern[] = "/dddd/dd/dd/";
+    for (i = 0; pattern[i]; ++i) {
+        if (pattern[i] == 'd') {
+            if (!isdigit (relative[i])) return 0;
+        } else if (relative[i] != pattern[i]) {
+            return 0;
+        }
+    }
+    return (atoi (relative + 1) * 10000)
+           + (atoi (relative + 6) * 100) + atoi (relative + 9);
+}
+
+static const char *dvr_store_video (const char *method, const char *uri,
+                                    const char *data, int length) {
+
+    char path[1024];
+    char ascii[128];
+    struct stat info;
+
+    const char *relative = uri + strlen (HouseDvrUri);
+    if ((*relative != '/') || strstr (relative, "..") ||
+        strstr (relative, "/.")) {
+        echttp_error (404, "Not Found"); // No hidden or external files.
+        return "";
+    }
+    housedvr_store_path (path, sizeof(path), relative + 1);
+
+    int fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        echttp_error (404, "Not Found");
+        return "";
+    }
+    if (fstat (fd, &info) || (!S_ISREG(info.st_mode))) {
+        close (fd);
+        echttp_error (404, "Not Found");
+        return "";
+    }
+    long long size = (long long)info.st_size;
+
+    // echttp transfers at most 2 GB at once.
+    if (size > INT_MAX) {
+        close (fd);
+        echttp_error (500, "File too large");
+        return "";
+    }
+
+    // A recording never changes once stored, except for the recent files,
+    // which might still be replaced by a more complete transfer. The links
+    // (Today, Yesterday) point to another day after midnight.
+    //
+    time_t now = time(0);
+    int date = dvr_store_video_date (relative);
+    if (date && (date != housedvr_store_date (now)) &&
+        (date != housedvr_store_date (now - 86400)))
+        echttp_attribute_set ("Cache-Control",
+                              "public, max-age=31536000, immutable");
+    else
+        echttp_attribute_set ("Cache-Control", "no-cache");
+
+    snprintf (ascii, sizeof(ascii), "\"%llx-%llx\"",
+              size, (long long)(info.st_mtime));
+    echttp_attribute_set ("ETag", ascii);
+    echttp_attribute_set ("Accept-Ranges", "bytes");
+
+    const char *match = echttp_attribute_get ("If-None-Match");
+    if (match && (!strcmp (match, ascii))) {
+        close (fd);
+        echttp_error (304, "Not Modified");
+        return "";
+    }
+    echttp_content_type_set (dvr_store_video_type (path));
+
+    const char *range = echttp_attribute_get ("Range");
+    if (range) {
+        // Ignore the range if the file changed since the client's copy.
+        const char *condition = echttp_attribute_get ("If-Range");
+        if (condition && strcmp (condition, ascii)) range = 0;
+    }
+    if (range) {
+        long long start, end;
+        switch (dvr_store_video_range (range, size, &start, &end)) {
+            case 0:
+                close (fd);
+                snprintf (ascii, sizeof(ascii), "bytes */%lld", size);
+                echttp_attribute_set ("Content-Range", ascii);
+                echttp_error (416, "Range Not Satisfiable");
+                return "";
+            case 1:
+                if (lseek (fd, (off_t)start, SEEK_SET) != (off_t)start) {
+                    close (fd);
+                    echttp_error (500, "Cannot access the file");
+                    return "";
+                }
+                snprintf (ascii, sizeof(ascii),
+                          "bytes %lld-%lld/%lld", start, end, size);
+                echttp_attribute_set ("Content-Range", ascii);
+                echttp_error (206, "Partial Content");
+                echttp_transfer (fd, (int)(end - start + 1));
+                return "";
+        }
+    }
+    echttp_transfer (fd, (int)size);
+    return "";
 }
 
 void housedvr_store_initialize (int argc, const char **argv) {
 
     int i;
     const char *max = 0;
+    const char *after = 0;
+    const char *rate = 0;
 
     for (i = 1; i < argc; ++i) {
         echttp_option_match ("-dvr-store=", argv[i], &HouseDvrStorage);
+        echttp_option_match ("-dvr-archive=", argv[i], &HouseDvrArchive);
+        echttp_option_match ("-dvr-archive-after=", argv[i], &after);
+        echttp_option_match ("-dvr-archive-rate=", argv[i], &rate);
         echttp_option_match ("-dvr-clean=", argv[i], &max);
     }
     if (max) {
         HouseDvrMaxSpace = atoi(max);
     }
-    echttp_route_uri ("/dvr/storage/top", dvr_store_top);
-    echttp_route_uri ("/dvr/storage/yearly", dvr_store_yearly);
-    echttp_route_uri ("/dvr/storage/monthly", dvr_store_monthly);
-    echttp_route_uri ("/dvr/storage/daily", dvr_store_daily);
-    echttp_static_route (HouseDvrUri, HouseDvrStorage);
+    if (after) {
+        HouseDvrArchiveAfter = atoi(after);
+        if (HouseDvrArchiveAfter < 1) HouseDvrArchiveAfter = 1;
+    }
+    if (rate) {
+        HouseDvrArchiveRate = atoll(rate) * 1024 * 1024;
+        if (HouseDvrArchiveRate <= 0) HouseDvrArchiveRate = 1024 * 1024;
+    }
+    DvrStarted = time(0);
+    housedvr_metrics_route ("/dvr/storage/top", dvr_store_top);
+    housedvr_metrics_route ("/dvr/storage/yearly", dvr_store_yearly);
+    housedvr_metrics_route ("/dvr/storage/monthly", dvr_store_monthly);
+    housedvr_metrics_route ("/dvr/storage/daily", dvr_store_daily);
+    housedvr_metrics_route ("/dvr/storage/thumbnails", dvr_store_thumbnails);
+    housedvr_metrics_route ("/dvr/storage/search", dvr_store_search);
+    housedvr_metrics_match (HouseDvrUri, dvr_store_video);
 }
 
 // Calculate storage space information (total, free, %used).
@@ -340,27 +1040,112 @@ static int housedvr_store_used (const struct statvfs *fs) {
     return (int)(((total - housedvr_store_free(fs)) * 100) / total);
 }
 
-int housedvr_store_status (char *buffer, int size) {
+// Record the amount of data added so far, to calculate the ingest rate.
+//
+static void housedvr_store_sample (time_t now) {
 
-    int cursor = 0;
+    DvrIngest[DvrIngestCursor] = housedvr_index_ingested ();
+    DvrIngestTime[DvrIngestCursor] = now;
+    DvrIngestCursor = (DvrIngestCursor + 1) % DVR_INGEST_SAMPLES;
+    if (DvrIngestCount < DVR_INGEST_SAMPLES) DvrIngestCount += 1;
+}
+
+// Return the ingest rate in bytes per second, over the sampled history.
+//
+static long long housedvr_store_rate (void) {
+
+    if (DvrIngestCount < 2) return 0;
+
+    int newest = (DvrIngestCursor + DVR_INGEST_SAMPLES - 1) % DVR_INGEST_SAMPLES;
+    int oldest = (DvrIngestCount < DVR_INGEST_SAMPLES) ? 0 : DvrIngestCursor;
+    time_t span = DvrIngestTime[newest] - DvrIngestTime[oldest];
+    if (span <= 0) return 0;
+    return (DvrIngest[newest] - DvrIngest[oldest]) / span;
+}
+
+// Estimate the current disk usage from the last check, and the data
+// added to the index since.
+//
+static long long housedvr_store_estimate (void) {
+    return DvrDisk.used + housedvr_index_ingested () - DvrDisk.ingested;
+}
+
+static long long housedvr_store_limit (void) {
+    if (HouseDvrMaxSpace <= 0) return DvrDisk.total;
+    return (DvrDisk.total / 100) * HouseDvrMaxSpace;
+}
+
+static void housedvr_store_build (HouseDvrBuffer *output) {
 
     struct statvfs storage;
+    int tier;
+    const char *sep = "";
 
-    if (statvfs (HouseDvrStorage, &storage)) return 0;
+    housedvr_buffer_reset (output);
+    housedvr_buffer_printf (output, "\"storage\":[");
+
+    for (tier = 0; tier < 2; ++tier) {
+        const char *root = tier ? HouseDvrArchive : HouseDvrStorage;
+        if (!root) break;
+        if (statvfs (root, &storage)) continue;
+        housedvr_buffer_printf (output,
+                                "%s{\"path\":\"%s\", \"tier\":\"%s\", \"used\":%d, \"size\":%lld, \"free\":%lld}",
+                                sep, root, tier ? "archive" : "main",
+                                housedvr_store_used (&storage),
+                                housedvr_store_total (&storage),
+                                housedvr_store_free (&storage));
+        sep = ",";
+    }
+    housedvr_buffer_printf (output, "]");
+
+    if (DvrMigration.started) {
+        housedvr_buffer_printf (output,
+                                ",\"migration\":{\"active\":%s,\"started\":%lld"
+                                    ",\"files\":%d,\"bytes\":%lld}",
+                                DvrMigration.date ? "true" : "false",
+                                (long long)(DvrMigration.started),
+                                DvrMigration.files, DvrMigration.bytes);
+    }
 
-    cursor = snprintf (buffer, size, "\"storage\":[{\"path\":\"%s\", \"used\":%d, \"size\":%lld, \"free\":%lld}]",
-                       HouseDvrStorage,
-                       housedvr_store_used (&storage),
-                       housedvr_store_total (&storage),
-                       housedvr_store_free (&storage));
-    if (cursor >= size) goto overflow;
+    if (DvrCleanup.started) {
+        housedvr_buffer_printf (output,
+                                ",\"cleanup\":{\"active\":%s,\"started\":%lld"
+                                    ",\"target\":%lld,\"freed\":%lld"
+                                    ",\"files\":%d,\"day\":\"%d/%02d/%02d\"}",
+                                DvrCleanup.active ? "true" : "false",
+                                (long long)(DvrCleanup.started),
+                                DvrCleanup.budget, DvrCleanup.freed,
+                                DvrCleanup.files,
+                                DvrCleanup.date / 10000,
+                                (DvrCleanup.date / 100) % 100,
+                                DvrCleanup.date % 100);
+    }
 
-    return cursor;
+    long long rate = housedvr_store_rate ();
+    long long full = -1;
+    if (rate > 0) {
+        long long room = housedvr_store_limit () - housedvr_store_estimate ();
+        full = (room > 0) ? room / rate : 0;
+    }
+    housedvr_buffer_printf (output,
+                            ",\"ingest\":{\"rate\":%lld,\"full\":%lld},",
+                            rate, full);
+    housedvr_index_status (output);
+}
+
+void housedvr_store_status (HouseDvrBuffer *output) {
+
+    static HouseDvrBuffer Cache;
+    static time_t CacheTime = 0;
 
-overflow:
-    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
-    buffer[0] = 0;
-    return 0;
+    // The disk usage changes all the time: refresh it every few seconds.
+    //
+    time_t now = time(0);
+    if (now >= CacheTime + DVR_STATUS_PERIOD) {
+        housedvr_store_build (&Cache);
+        CacheTime = now;
+    }
+    housedvr_buffer_append (output, Cache.data, Cache.length);
 }
 
 static int housedvr_store_oldest (const char *parent) {
@@ -422,6 +1207,7 @@ static void housedvr_store_cleanup (void) {
     oldestmonth = housedvr_store_oldest (path);
     if (!oldestmonth) {
         housedvr_store_delete (path);
+        housedvr_index_forget (oldestyear, 0, 0);
         houselog_event ("DIRECTORY", path, "DELETED", "EMPTY");
         return;
     }
@@ -432,18 +1218,384 @@ static void housedvr_store_cleanup (void) {
 
     if (!oldestday) {
         housedvr_store_delete (path);
+        housedvr_index_forget (oldestyear, oldestmonth, 0);
         houselog_event ("DIRECTORY", path, "DELETED", "EMPTY");
         return;
     }
     snprintf (path, sizeof(path), "%s/%d/%02d/%02d",
               HouseDvrStorage, oldestyear, oldestmonth, oldestday);
     housedvr_store_delete (path);
+    housedvr_index_forget (oldestyear, oldestmonth, oldestday);
+    dvr_store_thumbnails_forget
+        ((oldestyear * 10000) + (oldestmonth * 100) + oldestday);
 
     snprintf (path, sizeof(path), "%d/%02d/%02d",
               oldestyear, oldestmonth, oldestday);
     houselog_event ("DIRECTORY", path, "DELETED", "TO FREE DISK SPACE");
 }
 
+// Delete what is left of a day once all its indexed recordings have been
+// deleted, and then the month and year directories if they became empty.
+//
+static void housedvr_store_purgeday (int date) {
+
+    char path[1024];
+    int year = date / 10000;
+    int month = (date / 100) % 100;
+    int day = date % 100;
+
+    int tier;
+    int monthleft = 0;
+    int yearleft = 0;
+
+    for (tier = 0; tier < 2; ++tier) {
+        const char *root = tier ? HouseDvrArchive : HouseDvrStorage;
+        if (!root) break;
+        snprintf (path, sizeof(path),
+                  "%s/%d/%02d/%02d", root, year, month, day);
+        housedvr_store_delete (path);
+        snprintf (path, sizeof(path), "%s/%d/%02d", root, year, month);
+        if (rmdir (path) && (errno != ENOENT)) monthleft = yearleft = 1;
+        snprintf (path, sizeof(path), "%s/%d", root, year);
+        if (rmdir (path) && (errno != ENOENT)) yearleft = 1;
+    }
+    housedvr_index_forget (year, month, day);
+    dvr_store_thumbnails_forget (date);
+
+    snprintf (path, sizeof(path), "%d/%02d/%02d", year, month, day);
+    houselog_event ("DIRECTORY", path, "DELETED", "TO FREE DISK SPACE");
+
+    if (monthleft) return;
+    housedvr_index_forget (year, month, 0);
+    if (yearleft) return;
+    housedvr_index_forget (year, 0, 0);
+}
+
+// Delete one recording, and then its day if nothing is left of it (except
+// for the current day, which will receive new recordings).
+//
+static void housedvr_store_remove (const char *relative, time_t now) {
+
+    char path[1024];
+    int year, month, day;
+
+    housedvr_store_path (path, sizeof(path), relative);
+    DEBUG ("delete %s\n", path);
+    unlink (path);
+
+    int parsed = sscanf (relative, "%4d/%2d/%2d", &year, &month, &day);
+    housedvr_index_delete (relative); // Invalidates relative.
+    if (parsed != 3) return;
+
+    int date = (year * 10000) + (month * 100) + day;
+    if (housedvr_index_first (date, 0)) return;
+    if (date == housedvr_store_date (now)) return;
+    if (housedvr_transfer_pending (date)) return;
+    housedvr_store_purgeday (date);
+}
+
+// Delete the recordings of the cameras that are over their retention
+// limits, a few at a time.
+//
+static void housedvr_store_expire (time_t now) {
+
+    int i;
+    for (i = 0; i < DVR_CLEANUP_BATCH; ++i) {
+        const char *victim = housedvr_retention_victim (now, 0);
+        if (!victim) return;
+        housedvr_store_remove (victim, now);
+    }
+}
+
+static void housedvr_store_purge_end (void) {
+
+    DvrCleanup.active = 0;
+    DvrDisk.used -= DvrCleanup.freed; // Until the next disk check.
+    houselog_event ("DISK", HouseDvrStorage, "CLEANED",
+                    "%lld MB FREED IN %d FILES",
+                    DvrCleanup.freed / (1024 * 1024), DvrCleanup.files);
+}
+
+// Delete the oldest recordings, a few at a time, until the budget is met.
+//
+static void housedvr_store_purge (time_t now) {
+
+    char path[1024];
+    int i;
+
+    for (i = 0; i < DVR_CLEANUP_BATCH; ++i) {
+
+        if (DvrCleanup.freed >= DvrCleanup.budget) {
+            housedvr_store_purge_end ();
+            return;
+        }
+        long long size = 0;
+
+        // The cameras over their retention limits go first.
+        const char *victim = housedvr_retention_victim (now, &size);
+        if (victim) {
+            housedvr_store_remove (victim, now);
+            DvrCleanup.freed += size;
+            DvrCleanup.files += 1;
+            continue;
+        }
+
+        int date = housedvr_index_oldest ();
+        if (!date) {
+            // Nothing is indexed: fall back to deleting a whole day.
+            // The space freed is unknown until the next disk check.
+            housedvr_store_cleanup ();
+            housedvr_store_purge_end ();
+            DvrDisk.total = 0;
+            return;
+        }
+        DvrCleanup.date = date;
+
+        const char *oldest = housedvr_index_first (date, &size);
+        if (!oldest) {
+            // Never remove a day where files can still be written: the
+            // temporary files of the transfers would be lost.
+            if ((date == housedvr_store_date (now)) ||
+                housedvr_transfer_pending (date)) {
+                housedvr_store_purge_end ();
+                return;
+            }
+            housedvr_store_purgeday (date);
+            continue;
+        }
+        housedvr_store_path (path, sizeof(path), oldest);
+        DEBUG ("delete %s\n", path);
+        unlink (path);
+        housedvr_index_delete (oldest);
+        DvrCleanup.freed += size;
+        DvrCleanup.files += 1;
+    }
+}
+
+static void housedvr_store_migrate_abort (void) {
+
+    char path[1024];
+    const char *name = strrchr (DvrMigration.path, '/');
+
+    if (DvrMigration.in >= 0) close (DvrMigration.in);
+    if (DvrMigration.out >= 0) {
+        close (DvrMigration.out);
+        snprintf (path, sizeof(path), "%s/%.*s/.%s.part", HouseDvrArchive,
+                  (int)(name - DvrMigration.path), DvrMigration.path, name + 1);
+        unlink (path);
+    }
+    DvrMigration.in = DvrMigration.out = -1;
+}
+
+// Open the file to migrate, and create its copy in the archive. Return 1
+// on success, 0 if the file does not exist anymore, -1 on error.
+//
+static int housedvr_store_migrate_open (const char *relative) {
+
+    char path[1024];
+    char *sep;
+
+    snprintf (DvrMigration.path, sizeof(DvrMigration.path), "%s", relative);
+    const char *name = strrchr (DvrMigration.path, '/');
+    if (!name) return -1;
+
+    snprintf (path, sizeof(path), "%s/%s", HouseDvrStorage, relative);
+    DvrMigration.in = open (path, O_RDONLY);
+    if (DvrMigration.in < 0) return (errno == ENOENT) ? 0 : -1;
+
+    // Create the archive's year, month and day directories, as needed.
+    snprintf (path, sizeof(path), "%s/%.*s/.%s.part", HouseDvrArchive,
+              (int)(name - DvrMigration.path), DvrMigration.path, name + 1);
+    for (sep = strchr (path + strlen(HouseDvrArchive) + 1, '/');
+         sep; sep = strchr (sep + 1, '/')) {
+        *sep = 0;
+        mkdir (path, 0755);
+        *sep = '/';
+    }
+    DvrMigration.out = open (path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (DvrMigration.out < 0) {
+        houselog_trace (HOUSE_FAILURE, path, "cannot create");
+        close (DvrMigration.in);
+        DvrMigration.in = -1;
+        return -1;
+    }
+    return 1;
+}
+
+// Copy up to the specified amount of data. Return the amount of data
+// copied, 0 at the end of the file, or -1 on error.
+//
+static long long housedvr_store_migrate_copy (long long length) {
+
+    static int supported = 1;
+    static char buffer[65536];
+
+    if (supported) {
+        ssize_t copied = copy_file_range (DvrMigration.in, 0,
+                                          DvrMigration.out, 0, length, 0);
+        if (copied >= 0) return copied;
+        if ((errno != ENOSYS) && (errno != EXDEV) &&
+            (errno != EINVAL) && (errno != EOPNOTSUPP)) return -1;
+        DEBUG ("copy_file_range() not supported, disabled\n");
+        supported = 0;
+    }
+    if (length > sizeof(buffer)) length = sizeof(buffer);
+    int got = read (DvrMigration.in, buffer, length);
+    if (got <= 0) return got;
+    if (write (DvrMigration.out, buffer, got) != got) return -1;
+    return got;
+}
+
+// Complete the migration of a file. Return 0 on error.
+//
+static int housedvr_store_migrate_close (void) {
+
+    char part[1024];
+    char path[1024];
+    struct stat info;
+    const char *name = strrchr (DvrMigration.path, '/');
+
+    // Keep the modification time, used for the entity tag.
+    int ok = (fstat (DvrMigration.in, &info) == 0);
+    if (ok) {
+        struct timespec times[2];
+        times[0] = info.st_atim;
+        times[1] = info.st_mtim;
+        futimens (DvrMigration.out, times);
+    }
+    if (close (DvrMigration.out)) ok = 0;
+    close (DvrMigration.in);
+    DvrMigration.in = DvrMigration.out = -1;
+
+    snprintf (part, sizeof(part), "%s/%.*s/.%s.part", HouseDvrArchive,
+              (int)(name - DvrMigration.path), DvrMigration.path, name + 1);
+
+    // The recording may have been deleted, or replaced, meanwhile: it
+    // will be migrated again later if it still exists.
+    if (ok && ((housedvr_index_tier (DvrMigration.path) != 0) ||
+               (housedvr_index_size (DvrMigration.path) != info.st_size))) {
+        unlink (part);
+        return 1;
+    }
+    snprintf (path, sizeof(path), "%s/%s", HouseDvrArchive, DvrMigration.path);
+    if ((!ok) || rename (part, path)) {
+        unlink (part);
+        return 0;
+    }
+    housedvr_index_archived (DvrMigration.path);
+    snprintf (path, sizeof(path), "%s/%s", HouseDvrStorage, DvrMigration.path);
+    unlink (path);
+    DvrMigration.files += 1;
+    DvrMigration.bytes += info.st_size;
+    return 1;
+}
+
+// All the recordings of a day were migrated: remove the day's directory
+// on the main storage, if empty. Anything else that was left there, for
+// example the temporary file of an ongoing transfer, is kept. The cached
+// thumbnails stay valid, as they do not depend on the tier.
+//
+static void housedvr_store_migrate_end (int date) {
+
+    char path[1024];
+    int year = date / 10000;
+    int month = (date / 100) % 100;
+
+    snprintf (path, sizeof(path), "%s/%d/%02d/%02d",
+              HouseDvrStorage, year, month, date % 100);
+    if (rmdir (path) == 0) {
+        snprintf (path, sizeof(path),
+                  "%s/%d/%02d", HouseDvrStorage, year, month);
+        rmdir (path);
+        snprintf (path, sizeof(path), "%s/%d", HouseDvrStorage, year);
+        rmdir (path);
+    } else {
+        DEBUG ("Directory %s not removed: %s\n", path, strerror(errno));
+    }
+
+    snprintf (path, sizeof(path), "%d/%02d/%02d", year, month, date % 100);
+    houselog_event ("DIRECTORY", path, "ARCHIVED", "TO %s", HouseDvrArchive);
+}
+
+// Move the old recordings to the archive, within the I/O budget for
+// the current second. The copy is split in small chunks, one per call,
+// so that the HTTP requests are not stalled for long.
+//
+static void housedvr_store_migrate (time_t now) {
+
+    static time_t second = 0;
+    static long long budget = 0;
+
+    if (!HouseDvrArchive) return;
+    if (now < DvrMigration.retry) return;
+
+    if (now != second) {
+        budget = HouseDvrArchiveRate;
+        second = now;
+    }
+    long long chunk = (budget < DVR_MIGRATE_CHUNK) ? budget : DVR_MIGRATE_CHUNK;
+    while (chunk > 0) {
+
+        if (DvrMigration.in < 0) {
+            if (!DvrMigration.date) {
+                // Migrate early if the main storage is too full, but
+                // never the current day.
+                int before = housedvr_store_date
+                                 (now - (86400 * HouseDvrArchiveAfter));
+                if ((HouseDvrMaxSpace > 0) && (DvrMainUsed > HouseDvrMaxSpace))
+                    before = housedvr_store_date (now);
+                // Skip the days that still have transfers going on.
+                int date = housedvr_index_unarchived (0, before);
+                while (date && housedvr_transfer_pending (date))
+                    date = housedvr_index_unarchived (date, before);
+                if (!date) return;
+                DvrMigration.date = date;
+                DvrMigration.started = now;
+                DvrMigration.files = 0;
+                DvrMigration.bytes = 0;
+            }
+            const char *next =
+                housedvr_index_first_tier (DvrMigration.date, 0, 0);
+            if (!next) {
+                housedvr_store_migrate_end (DvrMigration.date);
+                DvrMigration.date = 0;
+                return;
+            }
+            int opened = housedvr_store_migrate_open (next);
+            if (opened == 0) {
+                housedvr_index_delete (next); // The file is gone.
+                continue;
+            }
+            if (opened < 0) {
+                DvrMigration.date = 0;
+                DvrMigration.retry = now + 60;
+                return;
+            }
+        }
+        long long copied = housedvr_store_migrate_copy (chunk);
+        if (copied < 0) {
+            houselog_trace (HOUSE_FAILURE, DvrMigration.path,
+                            "cannot copy to the archive");
+            housedvr_store_migrate_abort ();
+            DvrMigration.date = 0;
+            DvrMigration.retry = now + 60;
+            return;
+        }
+        if (copied == 0) {
+            if (!housedvr_store_migrate_close ()) {
+                DvrMigration.date = 0;
+                DvrMigration.retry = now + 60;
+                return;
+            }
+            budget -= 4096; // Account for the file system overhead.
+            chunk -= 4096;
+            continue;
+        }
+        budget -= copied;
+        chunk -= copied;
+    }
+}
+
 static void housedvr_store_link (const char *name, struct tm *reference) {
 
     char path[512];
@@ -466,29 +1618,60 @@ static void housedvr_store_link (const char *name, struct tm *reference) {
 void housedvr_store_background (time_t now) {
 
     static time_t lastcheck = 0;
+    static time_t lastcleanup = 0;
     static int lastday = 0;
 
-    if (now > lastcheck + 60) {
+    // Delete a few files per second, whatever the HTTP activity.
+    if (now != lastcleanup) {
+        if (DvrCleanup.active)
+            housedvr_store_purge (now);
+        else
+            housedvr_store_expire (now);
+        lastcleanup = now;
+    }
 
-        // Scan every minute for disk full.
+    housedvr_store_migrate (now);
 
-        if (HouseDvrMaxSpace > 0) {
-            // The numer of loops is limited to avoid infinit loops if the
-            // filesystem cleanup fails (or it is full for some other reason).
-            int i;
-            for (i=0; i < 10; ++i) {
-                struct statvfs storage;
-                if (statvfs (HouseDvrStorage, &storage)) break;
-                int used = housedvr_store_used (&storage);
+    if (now >= lastcheck + DVR_CHECK_PERIOD) {
 
-                if (used <= HouseDvrMaxSpace) break;
+        // Read the actual disk usage every minute. The oldest recordings,
+        // the ones deleted by the cleanup, are on the archive, if any.
+        struct statvfs storage;
+        const char *oldest = HouseDvrArchive ? HouseDvrArchive : HouseDvrStorage;
+        if (statvfs (oldest, &storage) == 0) {
+            DvrDisk.total = housedvr_store_total (&storage);
+            DvrDisk.used = DvrDisk.total - housedvr_store_free (&storage);
+            DvrDisk.ingested = housedvr_index_ingested ();
+        }
+        if (HouseDvrArchive && (statvfs (HouseDvrStorage, &storage) == 0)) {
+            DvrMainUsed = housedvr_store_used (&storage);
+        }
+        housedvr_store_sample (now);
+    }
 
-                DEBUG ("Proceeding with disk cleanup (disk %d%% full)\n",
-                       (int)(((storage.f_blocks - storage.f_bavail) * 100) / storage.f_blocks));
-                houselog_event ("DISK", HouseDvrStorage, "FULL", "%d%% USED", used);
-                housedvr_store_cleanup();
-            }
+    // If the disk will be too full before the next check, start a cleanup
+    // for the amount of space needed to stay below the limit. The actual
+    // deletion is spread over the following calls.
+    //
+    if ((HouseDvrMaxSpace > 0) && (!DvrCleanup.active) && (DvrDisk.total > 0)) {
+        long long limit = housedvr_store_limit ();
+        long long expected = housedvr_store_estimate ()
+                             + (housedvr_store_rate () * DVR_CHECK_PERIOD);
+        if (expected > limit) {
+            int used = (int)((housedvr_store_estimate () * 100) / DvrDisk.total);
+            DvrCleanup.budget = expected - limit;
+            DvrCleanup.freed = 0;
+            DvrCleanup.files = 0;
+            DvrCleanup.started = now;
+            DvrCleanup.active = 1;
+            DEBUG ("Proceeding with disk cleanup (disk %d%% full)\n", used);
+            houselog_event ("DISK", HouseDvrStorage, "FULL",
+                            "%d%% USED, %lld MB TO FREE", used,
+                            DvrCleanup.budget / (1024 * 1024));
         }
+    }
+
+    if (now >= lastcheck + DVR_CHECK_PERIOD) {
 
         struct tm *local = localtime (&now);
         if (local) {
@@ -23,6 +23,7 @@
 
 void housedvr_store_initialize (int argc, const char **argv);
 const char *housedvr_store_root (void);
+const char *housedvr_store_archive (void);
 void housedvr_store_background (time_t now);
-int  housedvr_store_status (char *buffer, int size);
+void housedvr_store_status (HouseDvrBuffer *output);
 
@@ -31,13 +31,30 @@
  *
  *    Initialize this module.
  *
- * int housedvr_transfer_notify (const char *feed, const char *path, int size);
+ * int housedvr_transfer_notify (const char *feed, const char *path, int size,
+ *                               long long recorded, int urgent);
  *
  *    Tell this module that a specified file is available on the specified
  *    feed. The feed name is actually an URL to use as a base for the transfer.
+ *    The recorded time and the urgent flag (feed server short of space)
+ *    are used to prioritize the transfer.
  *
  *    The transfer does not start right away. If a transfer is necessary, it
- *    is scheduled for later, with transfers from one feed being serialized.
+ *    is scheduled for later. Up to -dvr-transfers=N transfers can run
+ *    concurrently, with at most -dvr-server-transfers=N (default 1)
+ *    transfers from the same feed server at a time, within the bandwidth
+ *    limits (see housedvr_shaper.c) and the limit of HTTP requests to the
+ *    same host (see housedvr_host.c). The urgent transfers
+ *    start first, then the most recent recordings: the older backlog is
+ *    transferred when there is nothing more recent to do.
+ *
+ *    If the queue is full, a new transfer replaces the queued transfer
+ *    with the lowest priority, if that one has a lower priority than the
+ *    new one. The replaced transfer will be notified again later.
+ *
+ *    If the file changed while being transferred (or verified), it is
+ *    queued again once that transfer is done: two transfers never write
+ *    to the same temporary file.
  *
  *    This function returns 1 if the notification was successfully processed,
  *    or 0 if it had to be ignored for lack of resource (e.g. queue full).
@@ -46,9 +63,51 @@
  *
  *    The periodic function that manages the video transfers.
  *
- * int housedvr_transfer_status (char *buffer, int size);
+ * void housedvr_transfer_status (HouseDvrBuffer *output);
+ *
+ *    A function that appends a status overview of the transfer queue in JSON.
+ *    The JSON text is cached, and is rebuilt only after the queue changed.
+ *
+ * int housedvr_transfer_pending (int date);
+ *
+ *    Return 1 if a transfer is queued or in progress for the specified
+ *    day (YYYYMMDD), 0 otherwise.
+ *
+ * A recording is downloaded into a hidden temporary file (".name.part")
+ * in the same directory, which is renamed to its final name only once
+ * the transfer completed. If a transfer fails, the temporary file is kept
+ * and the next transfer attempt for the same file resumes from where the
+ * previous one stopped, using a HTTP range request.
+ *
+ * The files queued for the same feed are transferred in batches of up to
+ * -dvr-batch=N files (default 16, 1 disables batching), using a single
+ * request: GET <feed>/recording/batch?files=PATH,PATH,... The response
+ * is a sequence of files, each one preceded by a header line "SIZE PATH"
+ * or "SIZE:CRC32C PATH" (SIZE is -1 if the file is not available, with
+ * no data following).
+ * The response is received into one hidden file at the root of the
+ * storage (echttp writes the data directly to a file descriptor), which
+ * is then split into the temporary files for each recording. Each file
+ * in the batch completes, or fails, on its own. If the feed server does
+ * not support batches, its files are transferred one at a time, and
+ * batching is attempted again an hour later.
+ *
+ * With the -dvr-journal=PATH option, each change of the queue (a file
+ * queued, transferred or failed) is appended to a memory-mapped journal
+ * file. At startup, the journal is replayed: the pending transfers are
+ * queued again right away (resuming from the temporary files), and the
+ * recent transfers are known without waiting for the CCTV services to
+ * be polled. The journal is compacted, i.e. rewritten with only the
+ * current state of the queue, when it is full and after each replay.
  *
- *    A function that populates a status overview of the transfer queue in JSON.
+ * Once a file has been received, its CRC32C checksum is computed by a
+ * helper thread (see housedvr_verify.c), before the file is renamed to
+ * its final name. The file is discarded if it is shorter than announced
+ * in the response, or if its checksum does not match the one provided
+ * by the feed, if any (X-Content-CRC32C response header, or the batch
+ * header line). The checksum is recorded in the index. If the checksum
+ * cannot be computed at all, the file is discarded too, unless the feed
+ * did not provide any checksum to check against.
  *
  * BUGS
  *
@@ -56,6 +115,8 @@
  * being the same on the local and feed servers.
  */
 
+#define _GNU_SOURCE // For fallocate() and copy_file_range().
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -67,6 +128,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
 
 #include <echttp.h>
 #include <echttp_static.h>
@@ -76,8 +139,14 @@
 #include "houselog.h"
 #include "housediscover.h"
 
+#include "housedvr_buffer.h"
 #include "housedvr_store.h"
+#include "housedvr_index.h"
+#include "housedvr_host.h"
+#include "housedvr_metrics.h"
+#include "housedvr_shaper.h"
 #include "housedvr_transfer.h"
+#include "housedvr_verify.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
@@ -86,9 +155,17 @@
 #define TRANSFER_STATE_ACTIVE 2
 #define TRANSFER_STATE_DONE   3
 #define TRANSFER_STATE_FAILED 4
+#define TRANSFER_STATE_VERIFY 5 // Received, checksum being computed.
+
+#define TRANSFER_BATCH_MAX    64
+#define TRANSFER_BATCH_BYTES  (16 * 1024 * 1024) // Limit the spool size.
+#define TRANSFER_BATCH_RETRY  3600 // How often to try again with old feeds.
 
-// This module uses a queue of transfer requests. All transfers are
-// serialized: there is only one transfer going at any time.
+// This module uses a queue of transfer requests. Multiple transfers may
+// be going on at the same time, each one occupying a transfer slot. The
+// number of slots is limited globally, and the number of slots used by
+// each feed server is limited as well, so that one slow server cannot
+// hold all the slots.
 //
 // The queue is implemented as a circular list (fixed array):
 // * avoid heap problems (leaks, double free, dangling pointer, etc.)
@@ -96,7 +173,7 @@
 // * keep the most recent transfer completed as a cache.
 //
 // New transfer requests are added using the TransferProducer cursor.
-// The TransferConsumer cursor points to the next transfer to start.
+// The TransferConsumer cursor points to the oldest transfer not completed.
 // TransferProducer == TransferConsumer: the queue is empty.
 // next(TransferProducer) == TransferConsumer: the queue is full.
 //
@@ -104,30 +181,47 @@
 // notified again and again anyway, so no need for an infinite queue.
 //
 // All items from TransferConsumer up to and excluding TransferProducer are
-// transfers either ongoing or idle.
+// transfers either ongoing or idle, or already completed: concurrent
+// transfers may complete out of order. The TransferConsumer cursor only
+// moves past a transfer once it has completed.
 //
 // All items from TransferProducer up to and excluding TransferConsumer are
 // either empty of transfers already executed, kept as a cache.
 //
-// Finding an item in the queue uses a linear search. This could be the most
-// expensive action in HouseDvr: if the cache is 128 items long, considering
-// an average of 32 items reported by the HouseMotion services, that means
-// doing 4096 string compare operations each cycle. Then all the items paths
-// tend to start with the same 14 characters (date), so there are more than
-// 57000 loops in strcmp() each cycle. Using a hash signature is one way to
-// filter out most non-matching paths in one CPU instruction, removing the
-// innermost loop and achieving a 14 times acceleration of the search.
-//
-// (This could use a full hash mechanism, but this is one step toward it.
-// Using echttp_cache is not trivial because it does not have a "remove"
-// operation.)
+// Finding an item in the queue could be the most expensive action in
+// HouseDvr: every recording reported by every HouseMotion service must be
+// looked up, on each cycle. A linear search would cost a number of string
+// compare operations proportional to the queue size for each reported file.
+// Instead the queue is indexed using an open addressing hash table (linear
+// probing) keyed on the file path, using the echttp hash signature. Each
+// entry of the hash table is the index of the most recent queue item for
+// that path, or -1 when the entry is free. The hash table is kept at least
+// twice the size of the queue, so that the probe sequences remain short.
+//
+// (Using echttp_cache is not trivial because it does not have a "remove"
+// operation. Here the removal uses backward shift deletion, to avoid the
+// accumulation of "deleted" markers.)
 // 
 struct TransferFile {
     unsigned int signature;
     int state;
     int size;
     int offset;
+    int slot;
+    int batch; // Next file in the same batch, or -1.
+    int verify; // 1 if the feed provided a checksum.
+    int submitted; // 1 if the checksum is being computed.
+    unsigned int digest; // The checksum provided by the feed.
+    long long length; // The size of the file, per the response (or -1).
+    int status; // The HTTP status received, kept while verifying.
+    int redo; // The new size, if the file changed while transferred, or -1.
     time_t initiated;
+    int urgent;
+    int shaper;
+    int host;
+    long long recorded;
+    long long queued;  // Monotonic time (ms) when queued.
+    long long started; // Monotonic time (ms) when started.
     char feed[128];
     char path[256];
 };
@@ -137,6 +231,72 @@ static int TransferQueueSize = 0;
 static int TransferConsumer = 0;
 static int TransferProducer = 0;
 
+// Incremented on each change of the queue, to invalidate the cached status.
+static int TransferGeneration = 0;
+
+static int TransferPending = 0; // Transfers idle or active, for the metrics.
+
+static int *TransferIndex = 0;
+static int  TransferIndexSize = 0; // Always a power of 2.
+
+// The transfer slots, each one pointing to an active item in the queue
+// (or -1 if free).
+//
+static int *TransferSlots = 0;
+static int  TransferSlotsSize = 0;
+static int  TransferActive = 0;
+static int  TransferPerServer = 1;
+
+static int  TransferBatchSize = 16;
+
+// The feed servers that do not support batches, and when this was detected.
+//
+struct TransferSingleFeed {
+    char feed[128];
+    time_t detected;
+};
+static struct TransferSingleFeed *TransferSingleFeeds = 0;
+static int TransferSingleFeedsCount = 0;
+static int TransferSingleFeedsSize = 0;
+
+// The journal is a header followed by fixed size records, each one a
+// copy of a queue item after it changed. A record is written at the end
+// of the journal, and its type is written last: a record of type 0, or
+// that does not match its path, is the end of the journal. The journal
+// can hold a few times more records than the queue: when it is full, it
+// is rewritten with one record per queue item.
+//
+#define TRANSFER_JOURNAL_MAGIC  "housedvr-journal 1"
+#define TRANSFER_JOURNAL_HEADER 64
+#define TRANSFER_JOURNAL_RATIO  4
+
+#define TRANSFER_JOURNAL_QUEUED 1
+#define TRANSFER_JOURNAL_DONE   2
+#define TRANSFER_JOURNAL_FAILED 3
+
+struct TransferJournalHeader {
+    char magic[32];
+    int  recordsize;
+    int  capacity;
+};
+
+struct TransferJournalRecord {
+    unsigned int signature; // Signature of the path.
+    int type;
+    int size;
+    int urgent;
+    long long recorded;
+    char feed[128];
+    char path[256];
+};
+
+static const char *TransferJournalPath = 0;
+static char *TransferJournal = 0;
+static int   TransferJournalCapacity = 0;
+static int   TransferJournalCount = 0;
+static int   TransferJournalDirty = 0;
+static int   TransferReplaying = 0;
+
 
 static void crashandburn (const char *file, int line) {
     char *invalid = (char *)1;
@@ -145,18 +305,58 @@ static void crashandburn (const char *file, int line) {
     *invalid = 0; // Crash on purpose.
 }
 
+static void housedvr_transfer_replay (void);
+static void housedvr_transfer_compact (void);
+static void housedvr_transfer_advance (void);
+static void housedvr_transfer_verified (int id, unsigned int digest,
+                                        long long size, int error);
+
 void housedvr_transfer_initialize (int argc, const char **argv) {
     int i;
     const char *size = 0;
+    const char *slots = 0;
+    const char *perserver = 0;
+    const char *batch = 0;
     for (i = 1; i < argc; ++i) {
         echttp_option_match ("-dvr-queue=", argv[i], &size);
+        echttp_option_match ("-dvr-transfers=", argv[i], &slots);
+        echttp_option_match ("-dvr-server-transfers=", argv[i], &perserver);
+        echttp_option_match ("-dvr-batch=", argv[i], &batch);
+        echttp_option_match ("-dvr-journal=", argv[i], &TransferJournalPath);
     }
     TransferQueueSize = 128; // Default size.
     if (size) TransferQueueSize = atoi (size);
     if (TransferQueueSize < 16) TransferQueueSize = 16; // self protection
-    if (TransferQueueSize > 256) TransferQueueSize = 256; // self protection
+    if (TransferQueueSize > 4096) TransferQueueSize = 4096; // self protection
 
     TransferQueue = calloc (TransferQueueSize, sizeof(struct TransferFile));
+
+    for (TransferIndexSize = 64;
+         TransferIndexSize < 2 * TransferQueueSize; TransferIndexSize *= 2) ;
+    TransferIndex = malloc (TransferIndexSize * sizeof(int));
+    for (i = 0; i < TransferIndexSize; ++i) TransferIndex[i] = -1;
+
+    TransferSlotsSize = 4; // Default number of concurrent transfers.
+    if (slots) TransferSlotsSize = atoi (slots);
+    if (TransferSlotsSize < 1) TransferSlotsSize = 1; // self protection
+    if (TransferSlotsSize > 32) TransferSlotsSize = 32; // self protection
+
+    TransferSlots = malloc (TransferSlotsSize * sizeof(int));
+    for (i = 0; i < TransferSlotsSize; ++i) TransferSlots[i] = -1;
+
+    if (perserver) TransferPerServer = atoi (perserver);
+    if (TransferPerServer < 1) TransferPerServer = 1; // self protection
+
+    if (batch) TransferBatchSize = atoi (batch);
+    if (TransferBatchSize < 1) TransferBatchSize = 1; // self protection
+    if (TransferBatchSize > TRANSFER_BATCH_MAX)
+        TransferBatchSize = TRANSFER_BATCH_MAX; // self protection
+
+    if (TransferJournalPath) {
+        housedvr_transfer_replay ();
+        housedvr_transfer_compact ();
+    }
+    housedvr_verify_initialize (housedvr_transfer_verified);
 }
 
 int housedvr_transfer_next (int index) {
@@ -164,121 +364,415 @@ int housedvr_transfer_next (int index) {
     return index;
 }
 
-int housedvr_transfer_notify (const char *feed, const char *path, int size) {
+// Return the most recent queue item for this path, or -1 if none.
+//
+static int housedvr_transfer_find (const char *path, unsigned int signature) {
 
-    int cached = 0;
-    struct TransferFile *cursor;
-    unsigned int signature = echttp_hash_signature (path);
+    int mask = TransferIndexSize - 1;
+    int i;
+    for (i = signature & mask; TransferIndex[i] >= 0; i = (i + 1) & mask) {
+        struct TransferFile *cursor = TransferQueue + TransferIndex[i];
+        if (cursor->signature != signature) continue; // Faster than strcmp().
+        if (!strcmp (cursor->path, path)) return TransferIndex[i];
+    }
+    return -1;
+}
 
-    // Was the file already transfered recently?
-    //
-    int index = TransferProducer;
-    if (index == TransferConsumer) // If empty, all slots are "past" transfer.
-        index = housedvr_transfer_next(index);
-    for (; index != TransferConsumer; index = housedvr_transfer_next(index)) {
+// Add a new queue item to the index. Any older item for the same path
+// is superseded by the new one.
+//
+static void housedvr_transfer_index (int item) {
 
-        cursor = TransferQueue + index;
-        if (cursor->signature != signature) continue; // Faster than strcmp().
-        if (strcmp (cursor->path, path)) continue;
+    struct TransferFile *added = TransferQueue + item;
+    int mask = TransferIndexSize - 1;
+    int i;
+    for (i = added->signature & mask;
+         TransferIndex[i] >= 0; i = (i + 1) & mask) {
+        struct TransferFile *cursor = TransferQueue + TransferIndex[i];
+        if (cursor->signature != added->signature) continue;
+        if (!strcmp (cursor->path, added->path)) break;
+    }
+    TransferIndex[i] = item;
+}
 
-        cached = 1;
-        switch (cursor->state) {
+// Remove a queue item from the index, if it is still indexed. The entries
+// that follow are shifted back, so that no probe sequence is broken.
+//
+static void housedvr_transfer_unindex (int item) {
+
+    int mask = TransferIndexSize - 1;
+    int i = TransferQueue[item].signature & mask;
+
+    while (TransferIndex[i] != item) {
+        if (TransferIndex[i] < 0) return; // Not indexed (superseded).
+        i = (i + 1) & mask;
+    }
+    int j = i;
+    for (;;) {
+        TransferIndex[i] = -1;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (TransferIndex[j] < 0) return;
+            int home = TransferQueue[TransferIndex[j]].signature & mask;
+            // Keep this entry in place if its home is cyclically in ]i, j].
+            if (i <= j) {
+                if ((home > i) && (home <= j)) continue;
+            } else {
+                if ((home > i) || (home <= j)) continue;
+            }
+            break;
+        }
+        TransferIndex[i] = TransferIndex[j];
+        i = j;
+    }
+}
+
+// Compare the priority of two transfers: return a positive value if the
+// first one has a higher priority.
+//
+static int housedvr_transfer_priority (int urgent1, long long recorded1,
+                                       int urgent2, long long recorded2) {
+
+    if (urgent1 != urgent2) return urgent1 - urgent2;
+    if (recorded1 > recorded2) return 1;
+    if (recorded1 < recorded2) return -1;
+    return 0;
+}
+
+// Find the idle transfer with the lowest priority, if it has a lower
+// priority than the one specified. Return its index, or -1.
+//
+static int housedvr_transfer_victim (int urgent, long long recorded) {
+
+    int victim = -1;
+    int index;
+    for (index = TransferConsumer;
+         index != TransferProducer; index = housedvr_transfer_next(index)) {
+
+        struct TransferFile *item = TransferQueue + index;
+        if (item->state != TRANSFER_STATE_IDLE) continue;
+        if (victim >= 0) {
+            struct TransferFile *lowest = TransferQueue + victim;
+            if (housedvr_transfer_priority (item->urgent, item->recorded,
+                                            lowest->urgent,
+                                            lowest->recorded) >= 0) continue;
+        } else if (housedvr_transfer_priority (item->urgent, item->recorded,
+                                               urgent, recorded) >= 0) {
+            continue;
+        }
+        victim = index;
+    }
+    return victim;
+}
+
+static size_t housedvr_transfer_journal_length (int capacity) {
+    return TRANSFER_JOURNAL_HEADER +
+               ((size_t)capacity * sizeof(struct TransferJournalRecord));
+}
+
+static struct TransferJournalRecord *housedvr_transfer_journal_record
+                                         (char *journal, int index) {
+    return (struct TransferJournalRecord *)
+               (journal + TRANSFER_JOURNAL_HEADER) + index;
+}
+
+// Create a new, empty, journal file and map it. Return 0 on failure.
+//
+static char *housedvr_transfer_journal_create (const char *path,
+                                               int capacity) {
+
+    size_t length = housedvr_transfer_journal_length (capacity);
+    int fd = open (path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) return 0;
+    if (ftruncate (fd, length)) {
+        close (fd);
+        return 0;
+    }
+    char *journal = mmap (0, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (journal == MAP_FAILED) return 0;
+
+    struct TransferJournalHeader *header =
+        (struct TransferJournalHeader *)journal;
+    snprintf (header->magic, sizeof(header->magic), TRANSFER_JOURNAL_MAGIC);
+    header->recordsize = sizeof(struct TransferJournalRecord);
+    header->capacity = capacity;
+    return journal;
+}
+
+static void housedvr_transfer_journal_write (char *journal, int index,
+                                             int type,
+                                             const struct TransferFile *item) {
+
+    struct TransferJournalRecord *record =
+        housedvr_transfer_journal_record (journal, index);
+
+    record->signature = item->signature;
+    record->size = item->size;
+    record->urgent = item->urgent;
+    record->recorded = item->recorded;
+    snprintf (record->feed, sizeof(record->feed), "%s", item->feed);
+    snprintf (record->path, sizeof(record->path), "%s", item->path);
+    __sync_synchronize (); // The record must be complete before it is valid.
+    record->type = type;
+}
+
+// Rewrite the journal with the current state of the queue, oldest first.
+// The new journal is built aside, then replaces the old one. If this
+// fails, the journal is disabled.
+//
+static void housedvr_transfer_compact (void) {
+
+    char temp[1024];
+    if (snprintf (temp, sizeof(temp),
+                  "%s.tmp", TransferJournalPath) >= sizeof(temp)) return;
+
+    int capacity = TransferQueueSize * TRANSFER_JOURNAL_RATIO;
+    char *journal = housedvr_transfer_journal_create (temp, capacity);
+
+    if (TransferJournal) {
+        munmap (TransferJournal,
+                housedvr_transfer_journal_length (TransferJournalCapacity));
+        TransferJournal = 0;
+    }
+    if (!journal) {
+        houselog_trace (HOUSE_FAILURE, temp, "cannot create the journal");
+        return;
+    }
+
+    int count = 0;
+    int index = TransferProducer;
+    do {
+        struct TransferFile *item = TransferQueue + index;
+        switch (item->state) {
+            case TRANSFER_STATE_IDLE:
+            case TRANSFER_STATE_ACTIVE:
+            case TRANSFER_STATE_VERIFY:
+                housedvr_transfer_journal_write
+                    (journal, count++, TRANSFER_JOURNAL_QUEUED, item);
+                break;
             case TRANSFER_STATE_DONE:
-                if (cursor->size == size) return 1; // Already done.
+                housedvr_transfer_journal_write
+                    (journal, count++, TRANSFER_JOURNAL_DONE, item);
                 break;
             case TRANSFER_STATE_FAILED:
-                break; // Keep looking for a successful one.
-            default:
-                crashandburn (__FILE__, __LINE__); // Should never happen.
+                housedvr_transfer_journal_write
+                    (journal, count++, TRANSFER_JOURNAL_FAILED, item);
+                break;
         }
+        index = housedvr_transfer_next (index);
+    } while (index != TransferProducer);
+
+    size_t length = housedvr_transfer_journal_length (capacity);
+    if (msync (journal, length, MS_SYNC) ||
+        rename (temp, TransferJournalPath)) {
+        houselog_trace (HOUSE_FAILURE, TransferJournalPath,
+                        "cannot replace the journal");
+        munmap (journal, length);
+        unlink (temp);
+        return;
     }
+    TransferJournal = journal;
+    TransferJournalCapacity = capacity;
+    TransferJournalCount = count;
+    TransferJournalDirty = 0;
+    DEBUG ("Compacted the journal to %d records\n", count);
+}
 
-    // Is the file already queued for transfer?
-    //
-    for (index = TransferConsumer;
-         index != TransferProducer; index = housedvr_transfer_next(index)) {
+// Record the new state of a queue item.
+//
+static void housedvr_transfer_journal (int type,
+                                       const struct TransferFile *item) {
 
-        cursor = TransferQueue + index;
-        if (cursor->signature != signature) continue; // Faster than strcmp().
-        if (strcmp (cursor->path, path)) continue;
+    if ((!TransferJournal) || TransferReplaying) return;
 
+    if (TransferJournalCount >= TransferJournalCapacity) {
+        housedvr_transfer_compact ();
+        return; // The compacted journal already holds the new state.
+    }
+    housedvr_transfer_journal_write
+        (TransferJournal, TransferJournalCount++, type, item);
+    TransferJournalDirty = 1;
+}
+
+int housedvr_transfer_notify (const char *feed, const char *path, int size,
+                              long long recorded, int urgent) {
+
+    int cached = 0;
+    struct TransferFile *cursor;
+    unsigned int signature = echttp_hash_signature (path);
+
+    // Was the file already transfered recently, or is it already queued?
+    //
+    int index = housedvr_transfer_find (path, signature);
+    if (index >= 0) {
+        cursor = TransferQueue + index;
         cached = 1;
         switch (cursor->state) {
-            case TRANSFER_STATE_ACTIVE:
-                if (cursor->size == size) return 1; // Already in progress.
+            case TRANSFER_STATE_DONE:
+                if (cursor->size == size) return 1; // Already done.
+                break;
+            case TRANSFER_STATE_FAILED:
                 break; // Need to request the transfer again.
+            case TRANSFER_STATE_ACTIVE:
+            case TRANSFER_STATE_VERIFY:
+                // Never start another transfer to the same temporary file:
+                // if the file changed, transfer it again once done.
+                cursor->redo = (cursor->size == size) ? -1 : size;
+                cursor->urgent = urgent;
+                return 1;
             case TRANSFER_STATE_IDLE:
-                cursor->size = size; // Update the upcoming transfer.
+                if ((cursor->size != size) || (cursor->urgent != urgent)) {
+                    cursor->size = size; // Update the upcoming transfer.
+                    cursor->urgent = urgent;
+                    housedvr_transfer_journal (TRANSFER_JOURNAL_QUEUED, cursor);
+                }
                 return 1; // Already queued.
             default:
                 crashandburn (__FILE__, __LINE__); // Should never happen.
         }
     }
 
-    // We need to make sure that the directory tree does exist, eventually.
-    //
-    char fullpath[512];
     if (strstr (path, "..")) return 1; // Security check: no arbitrary access.
-    int fpi = snprintf (fullpath, sizeof(fullpath),
-                            "%s/", housedvr_store_root());
-    if (fpi >= sizeof(fullpath)) return 1; // Cannot handle this name anyway.
-    int i;
-    for (i = 0; path[i] > 0; ++i) {
-        if (path[i] == '/') {
-            fullpath[fpi] = 0;
-            mkdir (fullpath, 0755);
-        }
-        fullpath[fpi++] = path[i];
-        if (fpi >= sizeof(fullpath)) return 1;
-    }
-    fullpath[fpi] = 0;
+    if (strlen (housedvr_store_root()) + strlen (path) + 2 > 512)
+        return 1; // Cannot handle this name anyway.
 
     if (! cached) {
         // We did not find this file in our recent transfers, so the
-        // next (more expensive) step is to check the local file system.
+        // next step is to check the index of the stored files. This
+        // index reflects the local file system, without accessing it.
         //
-        struct stat filestat;
-        if (stat (fullpath, &filestat) == 0) { // File exists.
-            if (filestat.st_size == size) return 1; // .. and is whole.
-        }
+        if (housedvr_index_size (path) == size) return 1; // Already stored.
     }
 
     // The file may be new or have changed. Add it to the transfer queue, if
     // there is room.
     //
     int next = housedvr_transfer_next(TransferProducer);
+    int slot = TransferProducer;
     if (next == TransferConsumer) {
-        // The queue is full. Ignore this file for now. The notification
+        // The queue is full. Replace a queued transfer of lower priority,
+        // if any. Otherwise ignore this file for now. The notification
         // will keep coming back anyway.
-        return 0;
+        //
+        slot = housedvr_transfer_victim (urgent, recorded);
+        if (slot < 0) {
+            housedvr_metrics_rejected (feed);
+            return 0;
+        }
+        cursor = TransferQueue + slot;
+        DEBUG ("Transfer of %s replaced by %s\n", cursor->path, path);
+        housedvr_metrics_rejected (cursor->feed);
+        housedvr_transfer_unindex (slot);
+        TransferPending -= 1;
+    } else {
+        cursor = TransferQueue + slot;
+        if ((cursor->state == TRANSFER_STATE_ACTIVE) ||
+            (cursor->state == TRANSFER_STATE_VERIFY) ||
+            (cursor->state == TRANSFER_STATE_IDLE))
+            crashandburn (__FILE__, __LINE__); // Should never happen.
+
+        if (cursor->state != TRANSFER_STATE_EMPTY)
+            housedvr_transfer_unindex (slot); // Recycle the slot.
+        TransferProducer = next;
     }
-    cursor = TransferQueue + TransferProducer;
-    if ((cursor->state == TRANSFER_STATE_ACTIVE) ||
-        (cursor->state == TRANSFER_STATE_IDLE))
-        crashandburn (__FILE__, __LINE__); // Should never happen.
 
     cursor->signature = signature;
     snprintf (cursor->feed, sizeof(cursor->feed), "%s", feed);
     snprintf (cursor->path, sizeof(cursor->path), "%s", path);
     cursor->size = size;
     cursor->offset = 0;
+    cursor->slot = -1;
+    cursor->batch = -1;
+    cursor->redo = -1;
+    cursor->urgent = urgent;
+    cursor->recorded = recorded;
+    cursor->shaper = housedvr_shaper_source (feed);
+    cursor->host = housedvr_host_find (feed);
     cursor->state = TRANSFER_STATE_IDLE;
-
-    TransferProducer = next;
+    cursor->queued = housedvr_metrics_clock();
+    housedvr_transfer_index (slot);
+    TransferPending += 1;
+    TransferGeneration += 1;
+    housedvr_transfer_journal (TRANSFER_JOURNAL_QUEUED, cursor);
     return 1;
 }
 
-static void housedvr_transfer_end (time_t now, int status);
+static void housedvr_transfer_finish (struct TransferFile *item,
+                                      time_t now, int status);
+static void housedvr_transfer_release (struct TransferFile *item);
+static void housedvr_transfer_end (struct TransferFile *item,
+                                   time_t now, int status);
+static void housedvr_transfer_start (time_t now);
+
+// Make sure that the directory tree does exist before creating the file.
+//
+static void housedvr_transfer_mkdir (const char *path) {
+
+    char fullpath[512];
+    int fpi = snprintf (fullpath, sizeof(fullpath),
+                            "%s/", housedvr_store_root());
+    if (fpi >= sizeof(fullpath)) return; // Cannot handle this name anyway.
+    int i;
+    for (i = 0; path[i] > 0; ++i) {
+        if (path[i] == '/') {
+            fullpath[fpi] = 0;
+            mkdir (fullpath, 0755);
+        }
+        fullpath[fpi++] = path[i];
+        if (fpi >= sizeof(fullpath)) return;
+    }
+    housedvr_index_calendar_add (path);
+}
+
+// Each asynchronous transfer response refers to its queue item: check
+// that it is still a legitimate active transfer.
+//
+static struct TransferFile *housedvr_transfer_active (void *origin) {
+
+    struct TransferFile *item = (struct TransferFile *)origin;
+    if ((item < TransferQueue) || (item >= TransferQueue + TransferQueueSize))
+        crashandburn (__FILE__, __LINE__); // Should never happen.
+    if (item->state != TRANSFER_STATE_ACTIVE)
+        crashandburn (__FILE__, __LINE__); // Should never happen.
+    if ((item->slot < 0) || (item->slot >= TransferSlotsSize))
+        crashandburn (__FILE__, __LINE__); // Should never happen.
+    if (TransferSlots[item->slot] != item - TransferQueue)
+        crashandburn (__FILE__, __LINE__); // Should never happen.
+    return item;
+}
+
+// Build the full path of the temporary file used while downloading.
+//
+static void housedvr_transfer_partial (const struct TransferFile *item,
+                                       char *buffer, int size) {
+
+    const char *name = strrchr (item->path, '/');
+    if (name) {
+        snprintf (buffer, size, "%s/%.*s/.%s.part",
+                  housedvr_store_root(),
+                  (int)(name - item->path), item->path, name + 1);
+    } else {
+        snprintf (buffer, size, "%s/.%s.part",
+                  housedvr_store_root(), item->path);
+    }
+}
 
 static int housedvr_transfer_open (struct TransferFile *item, int status) {
 
     char fullpath[512];
-    snprintf (fullpath, sizeof(fullpath),
-              "%s/%s", housedvr_store_root(), item->path);
+    housedvr_transfer_partial (item, fullpath, sizeof(fullpath));
 
     if (status == 206) {
         // Partial transfer, append to the existing file.
+        // Make sure that the server resumed where requested.
+        const char *range = echttp_attribute_get ("Content-Range");
+        if (range) {
+            if (strncmp (range, "bytes ", 6)) return -1;
+            if (atoi (range+6) != item->offset) return -1;
+        }
         int fd = open (fullpath, O_WRONLY);
+        if (fd < 0) return -1;
         lseek (fd, item->offset, SEEK_SET);
         return fd;
     } else if (status == 200) {
@@ -288,6 +782,53 @@ static int housedvr_transfer_open (struct TransferFile *item, int status) {
     return -1;
 }
 
+// Reserve the disk space for the whole file before receiving the data,
+// to limit fragmentation. The file size is not changed, so that it still
+// reflects how much data was actually received. If the file system does
+// not support this, do not try again.
+//
+static void housedvr_transfer_reserve (int fd, int offset, int length) {
+
+    static int supported = 1;
+
+    if ((!supported) || (length <= 0)) return;
+    if (fallocate (fd, FALLOC_FL_KEEP_SIZE, offset, length)) {
+        if ((errno == EOPNOTSUPP) || (errno == ENOSYS)) {
+            DEBUG ("fallocate() not supported, disabled\n");
+            supported = 0;
+        }
+    }
+}
+
+static int housedvr_transfer_write (int fd, const char *data, int length) {
+
+    while (length > 0) {
+        int written = write (fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// The feed may provide the checksum of the whole file (the new content
+// appended to a partial file included), as 8 hexadecimal digits.
+//
+static void housedvr_transfer_expect (struct TransferFile *item,
+                                      int status, int total) {
+
+    item->length = total + ((status == 206) ? item->offset : 0);
+
+    const char *digest = echttp_attribute_get ("X-Content-CRC32C");
+    if (digest) {
+        item->digest = (unsigned int) strtoul (digest, 0, 16);
+        item->verify = 1;
+    }
+}
+
 static void housedvr_transfer_ready
                (void *origin, int status, char *data, int length) {
 
@@ -297,17 +838,15 @@ static void housedvr_transfer_ready
     if (!ascii) return; // Should never happen.
     int total = atoi(ascii);
 
-    struct TransferFile *item = TransferQueue + TransferConsumer;
-    if (origin != item)
-        crashandburn (__FILE__, __LINE__); // Should never happen.
-    if (item->state != TRANSFER_STATE_ACTIVE)
-        crashandburn (__FILE__, __LINE__); // Should never happen.
+    struct TransferFile *item = housedvr_transfer_active (origin);
+    housedvr_transfer_expect (item, status, total);
 
     // Create the new file and write the already received data, if any.
     int fd = housedvr_transfer_open (item, status);
     if (fd < 0) return; // Should never happen,
+    housedvr_transfer_reserve (fd, (status == 206) ? item->offset : 0, total);
     if (length > 0) {
-        write (fd, data, length);
+        housedvr_transfer_write (fd, data, length);
     }
 
     // Tell echttp to write the remaining portion of the data, if any.
@@ -328,42 +867,401 @@ static void housedvr_transfer_complete
         return;
     }
 
-    struct TransferFile *item = TransferQueue + TransferConsumer;
-    if (origin != item)
-        crashandburn (__FILE__, __LINE__); // Should never happen.
-    if (item->state != TRANSFER_STATE_ACTIVE)
-        crashandburn (__FILE__, __LINE__); // Should never happen.
+    struct TransferFile *item = housedvr_transfer_active (origin);
 
     if ((status / 100) == 2) {
         if (length > 0) {
             int fd = housedvr_transfer_open (item, status);
-            write (fd, data, length);
-            close (fd);
+            if (fd >= 0) {
+                housedvr_transfer_write (fd, data, length);
+                close (fd);
+            }
         }
     }
 
-    housedvr_transfer_end (time(0), status);
+    time_t now = time(0);
+    housedvr_transfer_end (item, now, status);
+    housedvr_transfer_start (now); // Reuse the slot that was just freed.
 }
 
-static void housedvr_transfer_start (time_t now) {
+// Count how many transfer slots are used by the specified feed server.
+//
+static int housedvr_transfer_busy (const char *feed) {
 
-    if (TransferConsumer == TransferProducer) return; // Nothing to start.
+    int i;
+    int busy = 0;
+    for (i = 0; i < TransferSlotsSize; ++i) {
+        if (TransferSlots[i] < 0) continue;
+        if (!strcmp (TransferQueue[TransferSlots[i]].feed, feed)) busy += 1;
+    }
+    return busy;
+}
 
-    struct TransferFile *item = TransferQueue + TransferConsumer;
-    if (item->state == TRANSFER_STATE_ACTIVE) return; // Busy.
+// Return the offset where the transfer of this file would resume, i.e.
+// the size of the data received by a previous, interrupted, transfer.
+//
+static int housedvr_transfer_resumable (const struct TransferFile *item) {
+
+    char partial[512];
+    struct stat filestat;
+    housedvr_transfer_partial (item, partial, sizeof(partial));
+    if (stat (partial, &filestat) == 0) {
+        if ((filestat.st_size > 0) && (filestat.st_size < item->size))
+            return (int)(filestat.st_size);
+    }
+    return 0;
+}
 
-    if (item->state != TRANSFER_STATE_IDLE)
-        crashandburn (__FILE__, __LINE__); // Should never happen.
+static void housedvr_transfer_activate (struct TransferFile *item,
+                                        int slot, time_t now) {
 
+    item->slot = slot;
+    item->batch = -1;
+    item->verify = 0;
+    item->submitted = 0;
+    item->length = -1;
     item->state = TRANSFER_STATE_ACTIVE;
     item->initiated = now;
+    item->started = housedvr_metrics_clock();
+    TransferGeneration += 1;
+
+    housedvr_transfer_mkdir (item->path);
+
+    // If a previous transfer of the same file was interrupted, resume it.
+    //
+    item->offset = housedvr_transfer_resumable (item);
+    housedvr_shaper_charge (item->shaper, (long long)(item->size - item->offset));
+}
+
+// Can files be requested in batch from this feed server?
+//
+static int housedvr_transfer_batchable (const char *feed, time_t now) {
+
+    int i;
+    if (TransferBatchSize <= 1) return 0;
+    for (i = 0; i < TransferSingleFeedsCount; ++i) {
+        struct TransferSingleFeed *single = TransferSingleFeeds + i;
+        if (!strcmp (single->feed, feed))
+            return now >= single->detected + TRANSFER_BATCH_RETRY;
+    }
+    return 1;
+}
+
+static void housedvr_transfer_single (const char *feed, time_t now) {
+
+    int i;
+    for (i = 0; i < TransferSingleFeedsCount; ++i) {
+        if (!strcmp (TransferSingleFeeds[i].feed, feed)) break;
+    }
+    if (i >= TransferSingleFeedsCount) {
+        if (TransferSingleFeedsCount >= TransferSingleFeedsSize) {
+            TransferSingleFeedsSize += 16;
+            TransferSingleFeeds =
+                realloc (TransferSingleFeeds,
+                         TransferSingleFeedsSize * sizeof(*TransferSingleFeeds));
+        }
+        i = TransferSingleFeedsCount++;
+        snprintf (TransferSingleFeeds[i].feed,
+                  sizeof(TransferSingleFeeds[i].feed), "%s", feed);
+    }
+    TransferSingleFeeds[i].detected = now;
+    DEBUG ("Feed %s does not support batch transfers\n", feed);
+}
+
+// Add to the batch led by this (active) file the other idle files queued
+// for the same feed, except for the transfers to be resumed. Return 1 if
+// there are other files in the batch.
+//
+static int housedvr_transfer_gather (struct TransferFile *leader, time_t now) {
+
+    if (!housedvr_transfer_batchable (leader->feed, now)) return 0;
+
+    struct TransferFile *last = leader;
+    long long bytes = leader->size;
+    int count = 1;
+    int index;
+    for (index = TransferConsumer;
+         index != TransferProducer; index = housedvr_transfer_next(index)) {
+
+        if (count >= TransferBatchSize) break;
+
+        struct TransferFile *item = TransferQueue + index;
+        if (item->state != TRANSFER_STATE_IDLE) continue;
+        if (strcmp (item->feed, leader->feed)) continue;
+        if (bytes + item->size > TRANSFER_BATCH_BYTES) continue;
+        if (housedvr_transfer_resumable (item) > 0) continue;
+
+        housedvr_transfer_activate (item, leader->slot, now);
+        last->batch = index;
+        last = item;
+        bytes += item->size;
+        count += 1;
+    }
+    return count > 1;
+}
+
+// Build the full path of the file used to receive a batch.
+//
+static void housedvr_transfer_spool (const struct TransferFile *leader,
+                                     char *buffer, int size) {
+    snprintf (buffer, size,
+              "%s/.batch%d.part", housedvr_store_root(), leader->slot);
+}
+
+static long long housedvr_transfer_copy (int in, int out, long long length) {
+
+    static int supported = 1;
+    static char buffer[65536];
+
+    if (supported) {
+        ssize_t copied = copy_file_range (in, 0, out, 0, length, 0);
+        if (copied >= 0) return copied;
+        if ((errno != ENOSYS) && (errno != EXDEV) &&
+            (errno != EINVAL) && (errno != EOPNOTSUPP)) return -1;
+        DEBUG ("copy_file_range() not supported, disabled\n");
+        supported = 0;
+    }
+    if (length > sizeof(buffer)) length = sizeof(buffer);
+    int got = read (in, buffer, length);
+    if (got <= 0) return got;
+    if (housedvr_transfer_write (out, buffer, got)) return -1;
+    return got;
+}
+
+// Copy one file of the batch into its temporary file. Return the HTTP
+// status for this file.
+//
+static int housedvr_transfer_extract (int spool, off_t offset,
+                                      long long size,
+                                      const struct TransferFile *item) {
+
+    char partial[512];
+    housedvr_transfer_partial (item, partial, sizeof(partial));
+
+    int fd = open (partial, O_CREAT|O_WRONLY|O_TRUNC, 0777);
+    if (fd < 0) return 500;
+    housedvr_transfer_reserve (fd, 0, (int)size);
+
+    lseek (spool, offset, SEEK_SET);
+    while (size > 0) {
+        long long copied = housedvr_transfer_copy (spool, fd, size);
+        if (copied <= 0) break; // Error, or truncated batch.
+        size -= copied;
+    }
+    close (fd);
+    return (size > 0) ? 500 : 200;
+}
+
+// Split the batch received into the temporary file of each recording.
+// The status of each file is set only if it was found in the batch.
+//
+static void housedvr_transfer_demux (const char *spoolpath,
+                                     struct TransferFile **files,
+                                     int *statuses, int count) {
+
+    int spool = open (spoolpath, O_RDONLY);
+    if (spool < 0) return;
+
+    off_t offset = 0;
+    for (;;) {
+        char header[512];
+        ssize_t got = pread (spool, header, sizeof(header)-1, offset);
+        if (got <= 0) break;
+        header[got] = 0;
+        char *eol = strchr (header, '\n');
+        if (!eol) break; // Invalid or truncated batch.
+        *eol = 0;
+        char *path = strchr (header, ' ');
+        if (!path) break;
+        long long size = atoll (header);
+        char *digest = strchr (header, ':');
+        if (digest > path) digest = 0; // Not in the size field.
+        path += 1;
+        offset += (eol - header) + 1;
+
+        int i;
+        for (i = 0; i < count; ++i) {
+            if (!strcmp (files[i]->path, path)) break;
+        }
+        if (size < 0) {
+            if (i < count) statuses[i] = 404;
+            continue;
+        }
+        if (i < count) {
+            files[i]->length = size;
+            if (digest) {
+                files[i]->digest = (unsigned int) strtoul (digest + 1, 0, 16);
+                files[i]->verify = 1;
+            }
+            statuses[i] = housedvr_transfer_extract (spool, offset, size, files[i]);
+        }
+        offset += size;
+    }
+    close (spool);
+}
+
+// Complete all the files in the batch led by this file.
+//
+static void housedvr_transfer_batch_end (struct TransferFile *leader,
+                                         time_t now, int status) {
+
+    struct TransferFile *files[TRANSFER_BATCH_MAX];
+    int statuses[TRANSFER_BATCH_MAX];
+    int count = 0;
+    int i;
+
+    struct TransferFile *item;
+    for (item = leader; ; item = TransferQueue + item->batch) {
+        files[count] = item;
+        statuses[count] = ((status / 100) == 2) ? 500 : status;
+        count += 1;
+        if (item->batch < 0) break;
+    }
+
+    char spool[512];
+    housedvr_transfer_spool (leader, spool, sizeof(spool));
+    if ((status / 100) == 2) {
+        housedvr_transfer_demux (spool, files, statuses, count);
+    }
+    unlink (spool);
+
+    for (i = 0; i < count; ++i) {
+        housedvr_transfer_finish (files[i], now, statuses[i]);
+    }
+    housedvr_transfer_release (leader);
+}
+
+// The feed server does not support batches: put all the files back in
+// the queue, to be transferred one at a time.
+//
+static void housedvr_transfer_unbatch (struct TransferFile *leader,
+                                       time_t now) {
+
+    housedvr_transfer_single (leader->feed, now);
+
+    char spool[512];
+    housedvr_transfer_spool (leader, spool, sizeof(spool));
+    unlink (spool);
+
+    struct TransferFile *item;
+    for (item = leader; ; item = TransferQueue + item->batch) {
+        item->state = TRANSFER_STATE_IDLE;
+        housedvr_shaper_charge (item->shaper, -(long long)(item->size));
+        if (item->batch < 0) break;
+    }
+    housedvr_transfer_release (leader);
+}
+
+static void housedvr_transfer_batch_ready
+               (void *origin, int status, char *data, int length) {
+
+    if ((status / 100) != 2) return; // Let the response continue synchronously.
+
+    const char *ascii = echttp_attribute_get ("Content-Length");
+    if (!ascii) return; // Should never happen.
+    int total = atoi(ascii);
+
+    struct TransferFile *leader = housedvr_transfer_active (origin);
+
+    char spool[512];
+    housedvr_transfer_spool (leader, spool, sizeof(spool));
+    int fd = open (spool, O_CREAT|O_WRONLY|O_TRUNC, 0600);
+    if (fd < 0) return; // Should never happen,
+    housedvr_transfer_reserve (fd, 0, total);
+    if (length > 0) {
+        housedvr_transfer_write (fd, data, length);
+    }
+
+    // Tell echttp to write the remaining portion of the data, if any.
+    if (total > length) {
+        echttp_transfer (fd, total-length);
+    } else {
+        close (fd);
+    }
+}
+
+static void housedvr_transfer_batch_complete
+               (void *origin, int status, char *data, int length) {
+
+    status = echttp_redirected("GET");
+    if (!status) {
+        echttp_asynchronous (housedvr_transfer_batch_ready);
+        echttp_submit (0, 0, housedvr_transfer_batch_complete, origin);
+        return;
+    }
+
+    struct TransferFile *leader = housedvr_transfer_active (origin);
+
+    if ((status / 100) == 2) {
+        if (length > 0) {
+            char spool[512];
+            housedvr_transfer_spool (leader, spool, sizeof(spool));
+            int fd = open (spool, O_CREAT|O_WRONLY|O_TRUNC, 0600);
+            if (fd >= 0) {
+                housedvr_transfer_write (fd, data, length);
+                close (fd);
+            }
+        }
+    }
+
+    time_t now = time(0);
+    if ((status == 400) || (status == 404) || (status == 501)) {
+        housedvr_transfer_unbatch (leader, now);
+    } else {
+        housedvr_transfer_batch_end (leader, now, status);
+    }
+    housedvr_transfer_start (now); // Reuse the slot that was just freed.
+}
+
+static void housedvr_transfer_batch (struct TransferFile *leader,
+                                     time_t now) {
+
+    static HouseDvrBuffer url;
+    const char *sep = "";
+
+    housedvr_buffer_reset (&url);
+    housedvr_buffer_printf (&url, "%s/recording/batch?files=", leader->feed);
+    struct TransferFile *item;
+    for (item = leader; ; item = TransferQueue + item->batch) {
+        housedvr_buffer_printf (&url, "%s%s", sep, item->path);
+        sep = ",";
+        if (item->batch < 0) break;
+    }
+    const char *error = echttp_client ("GET", url.data);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, leader->feed, "%s", error);
+        housedvr_transfer_batch_end (leader, now, 500);
+        return;
+    }
+    echttp_asynchronous (housedvr_transfer_batch_ready);
+    echttp_submit (0, 0, housedvr_transfer_batch_complete, (void *)leader);
+}
+
+static void housedvr_transfer_launch (struct TransferFile *item, time_t now) {
+
+    int slot;
+    for (slot = 0; slot < TransferSlotsSize; ++slot) {
+        if (TransferSlots[slot] < 0) break;
+    }
+    if (slot >= TransferSlotsSize)
+        crashandburn (__FILE__, __LINE__); // Should never happen.
+
+    TransferSlots[slot] = item - TransferQueue;
+    TransferActive += 1;
+    housedvr_host_connect (item->host);
+    housedvr_transfer_activate (item, slot, now);
+
+    if ((item->offset == 0) && housedvr_transfer_gather (item, now)) {
+        housedvr_transfer_batch (item, now);
+        return;
+    }
 
     char url[512];
     snprintf (url, sizeof(url), "%s/recording/%s", item->feed, item->path);
     const char *error = echttp_client ("GET", url);
     if (error) {
         houselog_trace (HOUSE_FAILURE, url, "%s", error);
-        housedvr_transfer_end (now, 500);
+        housedvr_transfer_end (item, now, 500);
         return;
     }
     if (item->offset > 0) {
@@ -375,11 +1273,65 @@ static void housedvr_transfer_start (time_t now) {
     echttp_submit (0, 0, housedvr_transfer_complete, (void *)item);
 }
 
-static void housedvr_transfer_end (time_t now, int status) {
+// Start as many idle transfers as there are free slots, highest priority
+// first, skipping the feed servers that already use their share of the
+// slots, or of the bandwidth. Each free slot requires one pass through
+// the queue, but there are only a few slots.
+//
+static void housedvr_transfer_start (time_t now) {
 
-    struct TransferFile *item = TransferQueue + TransferConsumer;
-    if (item->state != TRANSFER_STATE_ACTIVE)
-        crashandburn (__FILE__, __LINE__); // Should never happen.
+    while (TransferActive < TransferSlotsSize) {
+
+        if (!housedvr_shaper_ready (-1)) return; // Global bandwidth used.
+
+        struct TransferFile *best = 0;
+        int index;
+        for (index = TransferConsumer;
+             index != TransferProducer; index = housedvr_transfer_next(index)) {
+
+            struct TransferFile *item = TransferQueue + index;
+            if (item->state != TRANSFER_STATE_IDLE) continue;
+            if (best &&
+                housedvr_transfer_priority (item->urgent, item->recorded,
+                                            best->urgent,
+                                            best->recorded) <= 0) continue;
+            if (housedvr_transfer_busy (item->feed) >= TransferPerServer)
+                continue;
+            if (housedvr_host_busy (item->host, 0)) continue;
+            if (!housedvr_shaper_ready (item->shaper)) continue;
+            best = item;
+        }
+        if (!best) return; // Nothing more that can be started.
+
+        housedvr_transfer_launch (best, now);
+    }
+}
+
+// Complete the transfer of one file, successful or not.
+//
+// Move the temporary file to its final name, and add it to the index.
+// Return the resulting status for the transfer: the HTTP status received
+// (200 or 206), or an error.
+//
+static int housedvr_transfer_store (struct TransferFile *item, int status,
+                                    long long size, unsigned int digest) {
+
+    char partial[512];
+    char fullpath[512];
+    housedvr_transfer_partial (item, partial, sizeof(partial));
+    snprintf (fullpath, sizeof(fullpath),
+              "%s/%s", housedvr_store_root(), item->path);
+    if (rename (partial, fullpath)) return 500;
+
+    housedvr_index_add (item->path, size);
+    if (digest) housedvr_index_digest_set (item->path, digest);
+    return status;
+}
+
+// Record the final status of a transfer: stored, or failed.
+//
+static void housedvr_transfer_conclude (struct TransferFile *item,
+                                        time_t now, int status) {
 
     if (status / 100 == 2) {
         char ascii[16];
@@ -401,17 +1353,176 @@ static void housedvr_transfer_end (time_t now, int status) {
                         status, item->path, item->feed);
         item->state = TRANSFER_STATE_FAILED;
     }
-    TransferConsumer = housedvr_transfer_next (TransferConsumer);
-    housedvr_transfer_start (now);
+    housedvr_transfer_journal ((item->state == TRANSFER_STATE_DONE) ?
+                                   TRANSFER_JOURNAL_DONE :
+                                   TRANSFER_JOURNAL_FAILED, item);
+    long long ended = housedvr_metrics_clock();
+    // A server may ignore the range, and send the whole file.
+    long long bytes = (long long)item->size;
+    if (status != 200) bytes -= item->offset;
+    housedvr_metrics_transfer (item->feed, status, bytes,
+                               ended - item->started,
+                               item->started - item->queued);
+
+    TransferPending -= 1;
+    TransferGeneration += 1;
+
+    if (item->redo >= 0) {
+        // The file changed during the transfer: queue it again.
+        int size = item->redo;
+        item->redo = -1;
+        housedvr_transfer_notify (item->feed, item->path,
+                                  size, item->recorded, item->urgent);
+    }
+}
+
+// Submit a received file to the checksum thread. If the thread is busy,
+// this is attempted again every second (see housedvr_transfer_background).
+//
+static int housedvr_transfer_verify (struct TransferFile *item) {
+
+    char partial[512];
+    housedvr_transfer_partial (item, partial, sizeof(partial));
+    int submitted = housedvr_verify_submit (item - TransferQueue, partial);
+    item->submitted = (submitted > 0);
+    return submitted;
+}
+
+// The checksum of a received file cannot be computed. The file is stored
+// anyway only if there was no checksum to check it against.
+//
+static int housedvr_transfer_unverified (struct TransferFile *item) {
+
+    char partial[512];
+    struct stat filestat;
+
+    housedvr_transfer_partial (item, partial, sizeof(partial));
+    if (item->verify) {
+        houselog_event ("TRANSFER", "dvr", "UNVERIFIED",
+                        "FOR FILE %s at %s (CANNOT COMPUTE CRC32C)",
+                        item->path, item->feed);
+        return 500;
+    }
+    if (stat (partial, &filestat)) return 500;
+    houselog_event ("TRANSFER", "dvr", "UNVERIFIED",
+                    "FOR FILE %s at %s (NO CRC32C)", item->path, item->feed);
+    return housedvr_transfer_store
+               (item, item->status, (long long)(filestat.st_size), 0);
+}
+
+// The checksum of a received file was computed: check it and store the
+// file, or discard it.
+//
+static void housedvr_transfer_verified (int id, unsigned int digest,
+                                        long long size, int error) {
+
+    if ((id < 0) || (id >= TransferQueueSize)) return;
+    struct TransferFile *item = TransferQueue + id;
+    if (item->state != TRANSFER_STATE_VERIFY)
+        crashandburn (__FILE__, __LINE__); // Should never happen.
+
+    int status;
+    if (error) {
+        status = 500;
+    } else if ((item->length >= 0) && (size != item->length)) {
+        status = 500; // The file changed meanwhile?
+    } else if (item->verify && (digest != item->digest)) {
+        char partial[512];
+        houselog_event ("TRANSFER", "dvr", "CORRUPTED",
+                        "FOR FILE %s at %s (CRC32C %08x, EXPECTED %08x)",
+                        item->path, item->feed, digest, item->digest);
+        housedvr_transfer_partial (item, partial, sizeof(partial));
+        unlink (partial); // Do not resume from corrupted data.
+        status = 500;
+    } else {
+        status = housedvr_transfer_store (item, item->status, size, digest);
+    }
+    housedvr_transfer_conclude (item, time(0), status);
+    housedvr_transfer_advance ();
+}
+
+// Complete the transfer of one file, successful or not. The file received
+// is stored only after its checksum was computed.
+//
+static void housedvr_transfer_finish (struct TransferFile *item,
+                                      time_t now, int status) {
+
+    if (item->state != TRANSFER_STATE_ACTIVE)
+        crashandburn (__FILE__, __LINE__); // Should never happen.
+
+    char partial[512];
+    housedvr_transfer_partial (item, partial, sizeof(partial));
+
+    if (status / 100 == 2) {
+        // A resumed transfer must result in the complete file, and the
+        // file must be as large as the response said.
+        struct stat filestat;
+        if (stat (partial, &filestat)) {
+            status = 500;
+        } else if ((status == 206) && (filestat.st_size != item->size)) {
+            status = 500;
+        } else if ((item->length >= 0) && (filestat.st_size != item->length)) {
+            status = 500; // Short write.
+        } else {
+            item->status = status;
+            if (housedvr_transfer_verify (item) >= 0) {
+                item->state = TRANSFER_STATE_VERIFY;
+                TransferGeneration += 1;
+                return;
+            }
+            status = housedvr_transfer_unverified (item);
+        }
+    } else if (status == 416) {
+        unlink (partial); // Cannot resume: start from scratch next time.
+    }
+    housedvr_transfer_conclude (item, now, status);
 }
 
-int housedvr_transfer_status (char *buffer, int size) {
+// Move the consumer cursor past all the transfers that completed,
+// except when an older transfer is still going.
+//
+static void housedvr_transfer_advance (void) {
+
+    while (TransferConsumer != TransferProducer) {
+        int state = TransferQueue[TransferConsumer].state;
+        if ((state != TRANSFER_STATE_DONE) &&
+            (state != TRANSFER_STATE_FAILED)) break;
+        TransferConsumer = housedvr_transfer_next (TransferConsumer);
+    }
+}
+
+// Free the transfer slot used by the specified file, and by all the other
+// files in the same batch, if any.
+//
+static void housedvr_transfer_release (struct TransferFile *item) {
+
+    TransferSlots[item->slot] = -1;
+    TransferActive -= 1;
+    TransferGeneration += 1;
+    housedvr_host_disconnect (item->host);
+
+    for (;;) {
+        item->slot = -1;
+        if (item->batch < 0) break;
+        struct TransferFile *next = TransferQueue + item->batch;
+        item->batch = -1;
+        item = next;
+    }
+    housedvr_transfer_advance ();
+}
+
+static void housedvr_transfer_end (struct TransferFile *item,
+                                   time_t now, int status) {
+    housedvr_transfer_finish (item, now, status);
+    housedvr_transfer_release (item);
+}
+
+static void housedvr_transfer_build (HouseDvrBuffer *output) {
 
-    int cursor = 0;
     const char *sep = "";
 
-    cursor = snprintf (buffer, size, "\"queue\":[");
-    if (cursor >= size) goto overflow;
+    housedvr_buffer_reset (output);
+    housedvr_buffer_printf (output, "\"queue\":[");
 
     // List all entries in the queue, in FIFO order, i.e. oldest first.
     //
@@ -436,10 +1547,9 @@ int housedvr_transfer_status (char *buffer, int size) {
         }
         if (!state) continue; // Ignore empty slots.
 
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s{\"feed\":\"%s\", \"path\":\"%s\"%s}",
-                            sep, item->feed, item->path, state);
-        if (cursor >= size) goto overflow;
+        housedvr_buffer_printf (output,
+                                "%s{\"feed\":\"%s\", \"path\":\"%s\"%s}",
+                                sep, item->feed, item->path, state);
         sep = ",";
     }
     for (index = TransferConsumer;
@@ -451,36 +1561,156 @@ int housedvr_transfer_status (char *buffer, int size) {
             case TRANSFER_STATE_ACTIVE:
                 state = ",\"state\":\"active\"";
                 break;
+            case TRANSFER_STATE_VERIFY:
+                state = ",\"state\":\"verifying\"";
+                break;
             case TRANSFER_STATE_IDLE:
                 state = "";
                 break;
+            case TRANSFER_STATE_FAILED:
+                state = ",\"state\":\"failed\"";
+                break;
+            case TRANSFER_STATE_DONE:
+                state = ",\"state\":\"done\"";
+                break;
             default:
                 crashandburn (__FILE__,__LINE__);
         }
 
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s{\"feed\":\"%s\", \"path\":\"%s\"%s}",
-                            sep, item->feed, item->path, state);
-        if (cursor >= size) goto overflow;
+        housedvr_buffer_printf (output,
+                                "%s{\"feed\":\"%s\", \"path\":\"%s\"%s}",
+                                sep, item->feed, item->path, state);
         sep = ",";
     }
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    if (cursor >= size) goto overflow;
+    housedvr_buffer_printf (output, "]");
+}
 
-    return cursor;
+int housedvr_transfer_pending (int date) {
 
-overflow:
-    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
-    buffer[0] = 0;
+    char prefix[16];
+    int length = snprintf (prefix, sizeof(prefix), "%04d/%02d/%02d/",
+                           date / 10000, (date / 100) % 100, date % 100);
+
+    int index;
+    for (index = TransferConsumer;
+         index != TransferProducer; index = housedvr_transfer_next(index)) {
+        struct TransferFile *item = TransferQueue + index;
+        switch (item->state) {
+            case TRANSFER_STATE_IDLE:
+            case TRANSFER_STATE_ACTIVE:
+            case TRANSFER_STATE_VERIFY:
+                if (!strncmp (item->path, prefix, length)) return 1;
+                break;
+        }
+    }
     return 0;
 }
 
+void housedvr_transfer_status (HouseDvrBuffer *output) {
+
+    static HouseDvrBuffer Cache;
+    static int CacheGeneration = -1;
+
+    if (CacheGeneration != TransferGeneration) {
+        housedvr_transfer_build (&Cache);
+        CacheGeneration = TransferGeneration;
+    }
+    housedvr_buffer_append (output, Cache.data, Cache.length);
+}
+
+// Restore the queue from the journal. Each record is processed as a new
+// notification, then the recorded state is applied to the queue item if
+// the transfer completed. A transfer that was active when the journal
+// ended is queued again, and resumes from its temporary file.
+//
+static void housedvr_transfer_replay (void) {
+
+    int fd = open (TransferJournalPath, O_RDONLY);
+    if (fd < 0) return; // No journal yet.
+
+    struct stat info;
+    if (fstat (fd, &info) || (info.st_size < TRANSFER_JOURNAL_HEADER)) {
+        close (fd);
+        return;
+    }
+    char *journal = mmap (0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (journal == MAP_FAILED) return;
+
+    const struct TransferJournalHeader *header =
+        (const struct TransferJournalHeader *)journal;
+    if (strncmp (header->magic, TRANSFER_JOURNAL_MAGIC, sizeof(header->magic)) ||
+        (header->recordsize != sizeof(struct TransferJournalRecord))) {
+        houselog_trace (HOUSE_FAILURE, TransferJournalPath, "invalid journal");
+        munmap (journal, info.st_size);
+        return;
+    }
+    int capacity = (info.st_size - TRANSFER_JOURNAL_HEADER) /
+                       sizeof(struct TransferJournalRecord);
+
+    TransferReplaying = 1;
+    int i;
+    for (i = 0; i < capacity; ++i) {
+        struct TransferJournalRecord record =
+            *housedvr_transfer_journal_record (journal, i);
+        if (!record.type) break; // End of the journal.
+        record.feed[sizeof(record.feed)-1] = 0;
+        record.path[sizeof(record.path)-1] = 0;
+        if (record.signature != echttp_hash_signature (record.path)) break;
+
+        housedvr_transfer_notify (record.feed, record.path, record.size,
+                                  record.recorded, record.urgent);
+        if (record.type == TRANSFER_JOURNAL_QUEUED) continue;
+
+        int index = housedvr_transfer_find (record.path, record.signature);
+        if (index < 0) continue; // Already stored (see the index).
+        struct TransferFile *item = TransferQueue + index;
+        if (item->state != TRANSFER_STATE_IDLE) continue;
+        item->state = (record.type == TRANSFER_JOURNAL_DONE) ?
+                          TRANSFER_STATE_DONE : TRANSFER_STATE_FAILED;
+        TransferPending -= 1;
+    }
+    TransferReplaying = 0;
+    munmap (journal, info.st_size);
+
+    housedvr_transfer_advance ();
+    TransferGeneration += 1;
+    DEBUG ("Replayed %d journal records, %d transfers pending\n",
+           i, TransferPending);
+}
+
 void housedvr_transfer_background (time_t now) {
 
     static time_t lastcheck = 0;
 
     if (now == lastcheck) return;
     lastcheck = now;
+    housedvr_shaper_background (now);
     housedvr_transfer_start (now);
+    housedvr_metrics_queue (now, TransferPending, TransferActive);
+
+    // Submit the files that the checksum thread could not accept before.
+    int index;
+    int concluded = 0;
+    for (index = TransferConsumer;
+         index != TransferProducer; index = housedvr_transfer_next(index)) {
+        struct TransferFile *item = TransferQueue + index;
+        if ((item->state != TRANSFER_STATE_VERIFY) || item->submitted) continue;
+        int submitted = housedvr_transfer_verify (item);
+        if (submitted == 0) break; // Still busy.
+        if (submitted < 0) {
+            housedvr_transfer_conclude
+                (item, now, housedvr_transfer_unverified (item));
+            concluded = 1;
+        }
+    }
+    if (concluded) housedvr_transfer_advance ();
+
+    if (TransferJournalDirty) {
+        msync (TransferJournal,
+               housedvr_transfer_journal_length (TransferJournalCapacity),
+               MS_ASYNC);
+        TransferJournalDirty = 0;
+    }
 }
 
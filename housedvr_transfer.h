@@ -21,7 +21,9 @@
  * housedvr_transfer.c - Transfer recordings from the feed.
  */
 void housedvr_transfer_initialize (int argc, const char **argv);
-int  housedvr_transfer_notify (const char *feed, const char *path, int size);
+int  housedvr_transfer_notify (const char *feed, const char *path, int size,
+                               long long recorded, int urgent);
 void housedvr_transfer_background (time_t now);
-int  housedvr_transfer_status (char *buffer, int size);
+void housedvr_transfer_status (HouseDvrBuffer *output);
+int  housedvr_transfer_pending (int date);
 
@@ -0,0 +1,248 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedvr_verify.c - Compute the checksum of recordings, off the main loop.
+ *
+ * SYNOPSYS:
+ *
+ * This module computes the CRC32C (Castagnoli) checksum of files in a
+ * helper thread, so that reading a large recording never blocks the
+ * echttp event loop. The data of a transfer is written to the file by
+ * echttp itself, without passing through HouseDvr, so the checksum cannot
+ * be computed as the data arrives: it is computed from the file once the
+ * transfer completed, while the data is still in the page cache.
+ *
+ * The requests and the results go through two pipes, and the threads do
+ * not share any other data. The results pipe is registered with echttp,
+ * so that the results are processed in the main thread.
+ *
+ * The CRC32C is computed in software, 8 bytes at a time (slicing-by-8),
+ * which does not depend on the processor (HouseDvr often runs on ARM
+ * boards).
+ *
+ * void housedvr_verify_initialize (housedvr_verify_done *done);
+ *
+ *    Start the helper thread. The done function is called, in the main
+ *    thread, with the result of each request: the checksum and size
+ *    of the file, or an error (errno value).
+ *
+ * int housedvr_verify_submit (int id, const char *path);
+ *
+ *    Request the checksum of the specified file. Return 1 if the request
+ *    was accepted, 0 if the helper thread is busy (try again later) or
+ *    -1 if no checksum can be computed at all.
+ *
+ * unsigned int housedvr_verify_crc32c (unsigned int crc,
+ *                                      const char *data, int length);
+ *
+ *    Return the CRC32C of the data, continuing from the CRC of the
+ *    preceding data (0 initially). This can be used on its own, without
+ *    calling housedvr_verify_initialize().
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+
+#include "housedvr_verify.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define VERIFY_POLYNOMIAL 0x82f63b78 // CRC32C, reversed.
+
+static uint32_t VerifyTable[8][256];
+static int VerifyTableReady = 0;
+
+// Each request and result is smaller than PIPE_BUF, so that it is written
+// to the pipe in one piece.
+//
+struct VerifyRequest {
+    int id;
+    char path[512];
+};
+
+struct VerifyResult {
+    int id;
+    int error;
+    unsigned int digest;
+    long long size;
+};
+
+static int VerifyRequests[2] = {-1, -1};
+static int VerifyResults[2] = {-1, -1};
+
+static housedvr_verify_done *VerifyDone = 0;
+
+
+static void housedvr_verify_table (void) {
+
+    int i, j;
+    for (i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (j = 0; j < 8; ++j)
+            crc = (crc & 1) ? (crc >> 1) ^ VERIFY_POLYNOMIAL : crc >> 1;
+        VerifyTable[0][i] = crc;
+    }
+    for (i = 0; i < 256; ++i) {
+        uint32_t crc = VerifyTable[0][i];
+        for (j = 1; j < 8; ++j) {
+            crc = VerifyTable[0][crc & 0xff] ^ (crc >> 8);
+            VerifyTable[j][i] = crc;
+        }
+    }
+    VerifyTableReady = 1;
+}
+
+unsigned int housedvr_verify_crc32c (unsigned int crc,
+                                     const char *data, int length) {
+
+    const unsigned char *p = (const unsigned char *)data;
+    uint32_t c = ~crc;
+
+    if (!VerifyTableReady) housedvr_verify_table ();
+
+    while (length >= 8) {
+        uint32_t low = c ^ (p[0] | (p[1] << 8) | (p[2] << 16) |
+                            ((uint32_t)p[3] << 24));
+        uint32_t high = p[4] | (p[5] << 8) | (p[6] << 16) |
+                        ((uint32_t)p[7] << 24);
+        c = VerifyTable[7][low & 0xff] ^
+            VerifyTable[6][(low >> 8) & 0xff] ^
+            VerifyTable[5][(low >> 16) & 0xff] ^
+            VerifyTable[4][low >> 24] ^
+            VerifyTable[3][high & 0xff] ^
+            VerifyTable[2][(high >> 8) & 0xff] ^
+            VerifyTable[1][(high >> 16) & 0xff] ^
+            VerifyTable[0][high >> 24];
+        p += 8;
+        length -= 8;
+    }
+    while (length-- > 0) c = VerifyTable[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+
+// The helper thread: read each file requested and report its checksum.
+// This thread does not use any other HouseDvr or echttp function.
+//
+static void *housedvr_verify_worker (void *context) {
+
+    static char buffer[256*1024];
+    struct VerifyRequest request;
+
+    for (;;) {
+        ssize_t got = read (VerifyRequests[0], &request, sizeof(request));
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (got != sizeof(request)) break; // Closed, or invalid.
+        request.path[sizeof(request.path)-1] = 0;
+
+        struct VerifyResult result;
+        result.id = request.id;
+        result.error = 0;
+        result.digest = 0;
+        result.size = 0;
+
+        int fd = open (request.path, O_RDONLY);
+        if (fd < 0) {
+            result.error = errno;
+        } else {
+            for (;;) {
+                int length = read (fd, buffer, sizeof(buffer));
+                if (length < 0) {
+                    if (errno == EINTR) continue;
+                    result.error = errno;
+                    break;
+                }
+                if (length == 0) break;
+                result.digest =
+                    housedvr_verify_crc32c (result.digest, buffer, length);
+                result.size += length;
+            }
+            close (fd);
+        }
+        while (write (VerifyResults[1], &result, sizeof(result)) < 0) {
+            if (errno != EINTR) return 0;
+        }
+    }
+    return 0;
+}
+
+static void housedvr_verify_listen (int fd, int mode) {
+
+    struct VerifyResult result;
+    while (read (fd, &result, sizeof(result)) == sizeof(result)) {
+        if (VerifyDone)
+            VerifyDone (result.id, result.digest, result.size, result.error);
+    }
+}
+
+int housedvr_verify_submit (int id, const char *path) {
+
+    struct VerifyRequest request;
+
+    if (VerifyRequests[1] < 0) return -1;
+
+    request.id = id;
+    if (snprintf (request.path, sizeof(request.path),
+                  "%s", path) >= sizeof(request.path)) return -1;
+
+    if (write (VerifyRequests[1], &request, sizeof(request)) < 0) {
+        if (errno == EAGAIN) return 0;
+        return -1;
+    }
+    return 1;
+}
+
+void housedvr_verify_initialize (housedvr_verify_done *done) {
+
+    pthread_t worker;
+
+    housedvr_verify_table ();
+    VerifyDone = done;
+
+    if (pipe (VerifyRequests) || pipe (VerifyResults)) {
+        houselog_trace (HOUSE_FAILURE, "VERIFY", "cannot create pipes");
+        VerifyRequests[1] = -1;
+        return;
+    }
+    // The main thread must never block on these pipes.
+    fcntl (VerifyRequests[1], F_SETFL, O_NONBLOCK);
+    fcntl (VerifyResults[0], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create (&worker, 0, housedvr_verify_worker, 0)) {
+        houselog_trace (HOUSE_FAILURE, "VERIFY", "cannot start the thread");
+        VerifyRequests[1] = -1;
+        return;
+    }
+    pthread_detach (worker);
+    echttp_listen (VerifyResults[0], 1, housedvr_verify_listen, 0);
+    DEBUG ("Checksum thread started\n");
+}
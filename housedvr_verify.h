@@ -0,0 +1,29 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housedvr_verify.h - Compute the checksum of recordings, off the main loop.
+ */
+typedef void housedvr_verify_done (int id, unsigned int digest,
+                                   long long size, int error);
+
+void         housedvr_verify_initialize (housedvr_verify_done *done);
+int          housedvr_verify_submit (int id, const char *path);
+unsigned int housedvr_verify_crc32c (unsigned int crc,
+                                     const char *data, int length);
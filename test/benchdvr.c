@@ -0,0 +1,278 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * benchdvr.c - Microbenchmarks of the HouseDvr critical paths.
+ *
+ * SYNOPSYS:
+ *
+ * This program measures the performance of the HouseDvr functions that
+ * run for each recording, without any network or CCTV service involved:
+ *
+ * - notify: the lookup done for each recording reported by a CCTV
+ *   service, when that recording is already stored (the common case).
+ * - json: the decoding of a CCTV service status, as done by the poll.
+ * - search: a search through the index, for one camera.
+ * - crc32c: the checksum computed for each file received.
+ * - host: the per host limit, for a host running several CCTV services
+ *   (behind HousePortal) that is catching up on a transfer backlog. The
+ *   transfers must leave room for the polls, or the services are pruned.
+ *
+ * The daily list, which depends on the file system, is measured through
+ * HTTP by test/runbench.sh.
+ *
+ * The options are:
+ *
+ *   -bench-servers=N        The number of simulated CCTV services (200).
+ *   -bench-recordings=N     The number of recordings per service (2000).
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+
+#include "../housedvr_buffer.h"
+#include "../housedvr_store.h"
+#include "../housedvr_index.h"
+#include "../housedvr_host.h"
+#include "../housedvr_metrics.h"
+#include "../housedvr_shaper.h"
+#include "../housedvr_verify.h"
+#include "../housedvr_transfer.h"
+
+static int BenchServers = 200;
+static int BenchRecordings = 2000;
+
+static char BenchStore[] = "/tmp/benchdvrXXXXXX";
+
+static void bench_report (const char *name, long long start, int count) {
+
+    long long elapsed = housedvr_metrics_microseconds () - start;
+    if (elapsed <= 0) elapsed = 1;
+    printf ("%-8s %10d ops in %8lld us: %10.0f ops/s, %8.3f us/op\n",
+            name, count, elapsed,
+            (count * 1000000.0) / elapsed, (double)elapsed / count);
+}
+
+static void bench_recording (char *buffer, int size,
+                             int server, int recording, const char *ext) {
+
+    snprintf (buffer, size, "2024/01/%02d/%02d:%02d:%02d-fake%d:cam%d:%d.%s",
+              1 + (recording / 288) % 28,
+              (recording / 12) % 24, (recording % 12) * 5, 0,
+              server, recording % 4, recording, ext);
+}
+
+static void bench_notify (void) {
+
+    char path[256];
+    char feed[64];
+    int i, j;
+
+    long long start = housedvr_metrics_microseconds ();
+    for (i = 0; i < BenchServers; ++i) {
+        for (j = 0; j < BenchRecordings; ++j) {
+            bench_recording (path, sizeof(path), i, j, "mkv");
+            housedvr_index_add (path, 1024 * 1024);
+        }
+    }
+    bench_report ("index", start, BenchServers * BenchRecordings);
+
+    start = housedvr_metrics_microseconds ();
+    for (i = 0; i < BenchServers; ++i) {
+        snprintf (feed, sizeof(feed), "http://fake%d/cctv", i);
+        for (j = 0; j < BenchRecordings; ++j) {
+            bench_recording (path, sizeof(path), i, j, "mkv");
+            housedvr_transfer_notify (feed, path, 1024 * 1024, 0, 0);
+        }
+    }
+    bench_report ("notify", start, BenchServers * BenchRecordings);
+}
+
+static void bench_json (void) {
+
+    HouseDvrBuffer status = {0};
+    char path[256];
+    int i;
+
+    housedvr_buffer_printf (&status,
+                            "{\"host\":\"fake0\",\"timestamp\":1,\"updated\":1,"
+                                "\"cctv\":{\"console\":\"http://fake0\","
+                                "\"available\":\"100000 MB\","
+                                "\"feeds\":{\"cam0\":\"http://fake0/cam0\"},"
+                                "\"recordings\":[");
+    for (i = 0; i < BenchRecordings; ++i) {
+        bench_recording (path, sizeof(path), 0, i, "mkv");
+        housedvr_buffer_printf (&status, "%s[%d,\"%s\",1048576,true]",
+                                i ? "," : "", 1700000000 + i * 300, path);
+    }
+    housedvr_buffer_printf (&status, "]}}");
+
+    char *copy = malloc (status.length + 1);
+    int size = echttp_json_estimate (status.data) + 128;
+    ParserToken *tokens = malloc (size * sizeof(ParserToken));
+    int *list = malloc (size * sizeof(int));
+    int rounds = 100;
+    int found = 0;
+
+    long long start = housedvr_metrics_microseconds ();
+    for (i = 0; i < rounds; ++i) {
+        memcpy (copy, status.data, status.length + 1); // Parsing modifies it.
+        int count = size;
+        if (echttp_json_parse (copy, tokens, &count)) break;
+        int records = echttp_json_search (tokens, ".cctv.recordings");
+        if (records <= 0) break;
+        if (echttp_json_enumerate (tokens + records, list)) break;
+        int n = tokens[records].length;
+        int j;
+        for (j = 0; j < n; ++j) {
+            int field[16];
+            ParserToken *fileinfo = tokens + records + list[j];
+            if (echttp_json_enumerate (fileinfo, field)) continue;
+            if (fileinfo[field[1]].type == PARSER_STRING) found += 1;
+        }
+    }
+    bench_report ("json", start, rounds);
+    printf ("         %d bytes per status, %d recordings decoded\n",
+            status.length, found);
+    free (tokens);
+    free (list);
+    free (copy);
+    housedvr_buffer_free (&status);
+}
+
+static void bench_search (void) {
+
+    int i;
+    int rounds = 20;
+    int found = 0;
+
+    int source = housedvr_index_source_find ("fake0:cam1");
+    long long start = housedvr_metrics_microseconds ();
+    for (i = 0; i < rounds; ++i) {
+        long long cursor = 0;
+        while (housedvr_index_enumerate (source, 20240101, &cursor, 0))
+            found += 1;
+    }
+    bench_report ("search", start, rounds);
+    printf ("         %d recordings per search\n", found / rounds);
+}
+
+static void bench_crc32c (void) {
+
+    int i;
+    int rounds = 64;
+    int size = 1024 * 1024;
+    char *data = malloc (size);
+    unsigned int crc = 0;
+
+    for (i = 0; i < size; ++i) data[i] = (char)rand();
+
+    long long start = housedvr_metrics_microseconds ();
+    for (i = 0; i < rounds; ++i) {
+        crc = housedvr_verify_crc32c (crc, data, size);
+    }
+    long long lapsed = housedvr_metrics_microseconds () - start;
+    bench_report ("crc32c", start, rounds);
+    if (lapsed > 0)
+        printf ("         %.0f MB/s (crc %08x)\n",
+                (double)rounds * 1000000.0 / lapsed, crc);
+    free (data);
+}
+
+static void bench_host (void) {
+
+    char url[64];
+    int hosts[8];
+    int transfers = 0;
+    int polls = 0;
+    int i;
+
+    // One transfer per CCTV service, then one poll per CCTV service.
+    for (i = 0; i < 8; ++i) {
+        snprintf (url, sizeof(url), "http://fakehost/cctv-cam%d", i);
+        hosts[i] = housedvr_host_find (url);
+        if (housedvr_host_busy (hosts[i], 0)) continue;
+        housedvr_host_connect (hosts[i]);
+        transfers += 1;
+    }
+    for (i = 0; i < 8; ++i) {
+        if (housedvr_host_busy (hosts[i], 1)) continue;
+        housedvr_host_connect (hosts[i]);
+        polls += 1;
+    }
+    printf ("host     8 services on one host: %d transfers, %d polls started\n",
+            transfers, polls);
+    if (polls <= 0) printf ("         ERROR: the polls are starved\n");
+    for (i = 0; i < transfers + polls; ++i) housedvr_host_disconnect (hosts[0]);
+
+    int rounds = 1000000;
+    int busy = 0;
+    long long start = housedvr_metrics_microseconds ();
+    for (i = 0; i < rounds; ++i) busy += housedvr_host_busy (hosts[i % 8], 0);
+    bench_report ("host", start, rounds);
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-bench-servers=", argv[i], &value))
+            BenchServers = atoi (value);
+        if (echttp_option_match ("-bench-recordings=", argv[i], &value))
+            BenchRecordings = atoi (value);
+    }
+
+    if (!mkdtemp (BenchStore)) {
+        fprintf (stderr, "Cannot create the temporary storage\n");
+        return 1;
+    }
+    char option[256];
+    snprintf (option, sizeof(option), "-dvr-store=%s", BenchStore);
+    const char *options[] = {argv[0], option, "-dvr-queue=4096"};
+
+    housedvr_metrics_initialize (3, options);
+    housedvr_store_initialize (3, options);
+    housedvr_index_initialize (3, options);
+    housedvr_shaper_initialize (3, options);
+    housedvr_host_initialize (3, options);
+    housedvr_transfer_initialize (3, options);
+
+    printf ("HouseDvr benchmark: %d servers, %d recordings each\n",
+            BenchServers, BenchRecordings);
+    bench_notify ();
+    bench_json ();
+    bench_search ();
+    bench_crc32c ();
+    bench_host ();
+
+    rmdir (BenchStore);
+    return 0;
+}
@@ -0,0 +1,340 @@
+/* HouseDvr - a web server to store videos files from video sources.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * fakecctv.c - A simulated CCTV service, for benchmarking HouseDvr.
+ *
+ * SYNOPSYS:
+ *
+ * This program implements the part of the CCTV service web API that is
+ * used by HouseDvr: /cctv/check, /cctv/status (with the optional since
+ * parameter), /cctv/recording/... and /cctv/recording/batch?files=...,
+ * and registers with HousePortal as a "cctv" service. It generates its
+ * recordings instead of recording anything: the content of a recording
+ * is all zeroes.
+ *
+ * A fleet of CCTV services is simulated by running multiple instances
+ * of this program, each with its own name (see test/runbench.sh).
+ *
+ * The options are:
+ *
+ *   -cctv-name=NAME         The host name reported (default: fakecctv).
+ *   -cctv-cameras=N         The number of cameras (default 4).
+ *   -cctv-recordings=N      The number of recordings initially listed,
+ *                           spread over the previous days (default 2000).
+ *   -cctv-period=SECONDS    How often a new recording is created, on a
+ *                           random camera (default 10, 0 means never).
+ *   -cctv-size=KB           The size of each video file (default 1024).
+ *
+ * Each recording is listed as two files: a video and its image. Each file
+ * is served with its CRC32C checksum, as HouseDvr verifies it.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "echttp.h"
+
+#include "houseportalclient.h"
+
+#include "../housedvr_buffer.h"
+#include "../housedvr_verify.h"
+
+#define FAKE_IMAGE_SIZE 20480
+
+static const char *FakeName = "fakecctv";
+static int FakeCameras = 4;
+static int FakePeriod = 10;
+static long long FakeSize = 1024 * 1024;
+
+static unsigned int FakeVideoCrc = 0;
+static unsigned int FakeImageCrc = 0;
+
+typedef struct {
+    time_t time;
+    int camera;
+} FakeRecording;
+
+static FakeRecording *FakeRecordings = 0;
+static int FakeCount = 0;
+static int FakeSizeOfList = 0;
+
+static long long FakeUpdated = 0;
+
+static int FakeContent = -1; // A sparse file, as large as any recording.
+
+static int use_houseportal = 0;
+
+static void fake_add (time_t t, int camera) {
+
+    if (FakeCount >= FakeSizeOfList) {
+        FakeSizeOfList += 1024;
+        FakeRecordings =
+            realloc (FakeRecordings, FakeSizeOfList * sizeof(FakeRecording));
+    }
+    FakeRecordings[FakeCount].time = t;
+    FakeRecordings[FakeCount].camera = camera;
+    FakeCount += 1;
+    FakeUpdated = (long long)t * 1000 + FakeCount;
+}
+
+static void fake_path (char *buffer, int size,
+                       const FakeRecording *recording, const char *ext) {
+
+    struct tm *local = localtime (&(recording->time));
+    snprintf (buffer, size, "%04d/%02d/%02d/%02d:%02d:%02d-%s:cam%d:%d.%s",
+              local->tm_year + 1900, local->tm_mon + 1, local->tm_mday,
+              local->tm_hour, local->tm_min, local->tm_sec,
+              FakeName, recording->camera, (int)(recording - FakeRecordings),
+              ext);
+}
+
+static const char *fake_check (const char *method, const char *uri,
+                               const char *data, int length) {
+    static char buffer[256];
+
+    snprintf (buffer, sizeof(buffer),
+              "{\"host\":\"%s\",\"timestamp\":%lld,\"updated\":%lld}",
+              FakeName, (long long)time(0), FakeUpdated);
+    echttp_content_type_json ();
+    return buffer;
+}
+
+static const char *fake_status (const char *method, const char *uri,
+                                const char *data, int length) {
+
+    static HouseDvrBuffer Status;
+    char path[256];
+    int i;
+
+    const char *sinceparam = echttp_parameter_get ("since");
+    long long since = sinceparam ? atoll (sinceparam) : 0;
+
+    housedvr_buffer_reset (&Status);
+    housedvr_buffer_printf (&Status,
+                            "{\"host\":\"%s\",\"timestamp\":%lld,\"updated\":%lld,"
+                                "\"cctv\":{\"console\":\"http://%s:%d\","
+                                "\"available\":\"100000 MB\",\"feeds\":{",
+                            FakeName, (long long)time(0), FakeUpdated,
+                            FakeName, echttp_port(4));
+    for (i = 0; i < FakeCameras; ++i) {
+        housedvr_buffer_printf (&Status, "%s\"cam%d\":\"http://%s/cam%d\"",
+                                i ? "," : "", i, FakeName, i);
+    }
+    housedvr_buffer_printf (&Status, "},\"recordings\":[");
+
+    const char *sep = "";
+    for (i = 0; i < FakeCount; ++i) {
+        FakeRecording *recording = FakeRecordings + i;
+        if ((long long)(recording->time) <= since) continue;
+        fake_path (path, sizeof(path), recording, "mkv");
+        housedvr_buffer_printf (&Status, "%s[%lld,\"%s\",%lld,true]",
+                                sep, (long long)(recording->time),
+                                path, FakeSize);
+        fake_path (path, sizeof(path), recording, "jpg");
+        housedvr_buffer_printf (&Status, ",[%lld,\"%s\",%d,true]",
+                                (long long)(recording->time),
+                                path, FAKE_IMAGE_SIZE);
+        sep = ",";
+    }
+    housedvr_buffer_printf (&Status, "]}}");
+    echttp_content_type_json ();
+    return Status.data;
+}
+
+static long long fake_size (const char *path) {
+    const char *ext = strrchr (path, '.');
+    return (ext && (!strcmp (ext, ".jpg"))) ? FAKE_IMAGE_SIZE : FakeSize;
+}
+
+static unsigned int fake_crc (const char *path) {
+    const char *ext = strrchr (path, '.');
+    return (ext && (!strcmp (ext, ".jpg"))) ? FakeImageCrc : FakeVideoCrc;
+}
+
+// The content is all zeroes, so there are only two checksums to compute.
+//
+static unsigned int fake_crc_zeroes (long long size) {
+    static const char zeroes[65536];
+    unsigned int crc = 0;
+    while (size > 0) {
+        int length = (size > sizeof(zeroes)) ? sizeof(zeroes) : (int)size;
+        crc = housedvr_verify_crc32c (crc, zeroes, length);
+        size -= length;
+    }
+    return crc;
+}
+
+// Each file of the batch is preceded by a "SIZE:CRC32C PATH" line. The content
+// is never written: the batch is a sparse file, and reads as zeroes.
+//
+static const char *fake_batch (void) {
+
+    const char *files = echttp_parameter_get ("files");
+    if (!files) {
+        echttp_error (400, "Missing files parameter");
+        return "";
+    }
+    char batch[] = "/tmp/fakebatchXXXXXX";
+    int fd = mkstemp (batch);
+    if (fd < 0) {
+        echttp_error (500, "Cannot create the batch");
+        return "";
+    }
+    unlink (batch);
+
+    off_t total = 0;
+    while (*files) {
+        char path[256];
+        char header[512];
+        const char *end = strchr (files, ',');
+        int length = end ? (int)(end - files) : (int)strlen (files);
+        if (length >= sizeof(path)) break;
+        snprintf (path, sizeof(path), "%.*s", length, files);
+        int headlength = snprintf (header, sizeof(header), "%lld:%08x %s\n",
+                                   fake_size (path), fake_crc (path), path);
+        if (pwrite (fd, header, headlength, total) != headlength) break;
+        total += headlength + fake_size (path);
+        files += length;
+        if (*files == ',') files += 1;
+    }
+    if (ftruncate (fd, total)) {
+        close (fd);
+        echttp_error (500, "Cannot size the batch");
+        return "";
+    }
+    lseek (fd, 0, SEEK_SET);
+    echttp_content_type_set ("application/octet-stream");
+    echttp_transfer (fd, (int)total);
+    return "";
+}
+
+static const char *fake_recording (const char *method, const char *uri,
+                                   const char *data, int length) {
+
+    if (!strcmp (uri, "/cctv/recording/batch")) return fake_batch ();
+
+    long long size = fake_size (uri);
+    char crc[16];
+    snprintf (crc, sizeof(crc), "%08x", fake_crc (uri));
+
+    // Each transfer needs its own file offset: reopen the file.
+    char path[64];
+    snprintf (path, sizeof(path), "/proc/self/fd/%d", FakeContent);
+    int fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        echttp_error (500, "Cannot open the content");
+        return "";
+    }
+    echttp_content_type_set ("application/octet-stream");
+    echttp_attribute_set ("X-Content-CRC32C", crc);
+    echttp_transfer (fd, (int)size);
+    return "";
+}
+
+static void fake_background (int fd, int mode) {
+
+    static time_t LastRenewal = 0;
+    static time_t LastRecording = 0;
+    time_t now = time(0);
+
+    if (use_houseportal) {
+        static const char *path[] = {"cctv:/cctv"};
+        if (now >= LastRenewal + 60) {
+            if (LastRenewal > 0)
+                houseportal_renew();
+            else
+                houseportal_register (echttp_port(4), path, 1);
+            LastRenewal = now;
+        }
+    }
+    if ((FakePeriod > 0) && (now >= LastRecording + FakePeriod)) {
+        // The recording is listed once complete: dated one period ago.
+        if (LastRecording) fake_add (now - FakePeriod, rand() % FakeCameras);
+        LastRecording = now;
+    }
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    int recordings = 2000;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    echttp_default ("-http-service=dynamic");
+    argc = echttp_open (argc, argv);
+    if (echttp_dynamic_port()) {
+        houseportal_initialize (argc, argv);
+        use_houseportal = 1;
+    }
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-cctv-name=", argv[i], &FakeName);
+        if (echttp_option_match ("-cctv-cameras=", argv[i], &value))
+            FakeCameras = atoi (value);
+        if (echttp_option_match ("-cctv-recordings=", argv[i], &value))
+            recordings = atoi (value);
+        if (echttp_option_match ("-cctv-period=", argv[i], &value))
+            FakePeriod = atoi (value);
+        if (echttp_option_match ("-cctv-size=", argv[i], &value))
+            FakeSize = atoll (value) * 1024;
+    }
+    if (FakeCameras < 1) FakeCameras = 1;
+
+    // The initial recordings are spread over the previous days, one every
+    // few minutes, in chronological order.
+    //
+    srand (getpid());
+    time_t t = time(0) - ((time_t)recordings * 300);
+    for (i = 0; i < recordings; ++i) {
+        fake_add (t, rand() % FakeCameras);
+        t += 300;
+    }
+
+    char content[] = "/tmp/fakecctvXXXXXX";
+    FakeContent = mkstemp (content);
+    if (FakeContent < 0) {
+        fprintf (stderr, "Cannot create the recordings content\n");
+        return 1;
+    }
+    unlink (content);
+    if (ftruncate (FakeContent, (FakeSize > FAKE_IMAGE_SIZE) ?
+                                    FakeSize : FAKE_IMAGE_SIZE)) {
+        fprintf (stderr, "Cannot size the recordings content\n");
+        return 1;
+    }
+    FakeVideoCrc = fake_crc_zeroes (FakeSize);
+    FakeImageCrc = fake_crc_zeroes (FAKE_IMAGE_SIZE);
+
+    echttp_route_uri ("/cctv/check", fake_check);
+    echttp_route_uri ("/cctv/status", fake_status);
+    echttp_route_match ("/cctv/recording", fake_recording);
+    echttp_background (&fake_background);
+    echttp_loop();
+}
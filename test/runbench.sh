@@ -0,0 +1,50 @@
+#!/bin/bash
+# Run HouseDvr against a fleet of simulated CCTV services, and report the
+# transfer throughput and the HTTP latency. HousePortal must be running.
+#
+# Usage: runbench.sh [SERVERS [DURATION [RECORDINGS]]]
+#
+cd `dirname $0`
+current=`pwd`
+servers=${1:-20}
+duration=${2:-300}
+recordings=${3:-2000}
+port=8091
+storage=`dirname $current`/donotcommit/bench
+rm -rf $storage
+mkdir -p $storage
+
+pids=
+for i in `seq 1 $servers` ; do
+   ./fakecctv --cctv-name=fake$i --cctv-recordings=$recordings &
+   pids="$pids $!"
+done
+../housedvr --http-service=$port --dvr-store=$storage --dvr-queue=1024 &
+pids="$pids $!"
+trap "kill $pids 2> /dev/null" EXIT
+
+echo "== $servers CCTV services, $recordings recordings each, $duration seconds"
+sleep $duration
+du -sh $storage
+
+year=`date +%Y`
+month=`date +%m`
+day=`date +%d`
+url=http://localhost:$port/dvr
+
+# Repeat each query 100 times over the same connection, and report the
+# average time per query as seen by the client.
+query () {
+   local urls=
+   for i in `seq 1 100` ; do urls="$urls $1" ; done
+   curl -s -o /dev/null -w '%{time_total}\n' $urls | \
+      awk -v name=$2 '{t += $1} END {printf "%-8s %8.3f ms/query\n", name, 1000 * t / NR}'
+}
+
+query "$url/storage/daily?year=$year&month=$month&day=$day" daily
+query "$url/storage/search?limit=1000" search
+query "$url/status" status
+
+echo "== Server side metrics"
+curl -s $url/metrics
+echo